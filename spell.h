@@ -1,22 +1,62 @@
 // dictionary file name
 #define DICT_FILE "dictionary.txt"
-#define PARA_FILE "paragraph.txt"
+#define PARA_FILE "input.txt"       // default file for --check
+#define STREAM_CHUNK (1 << 20)      // bytes read at a time by --stream
+#define CHECK_CHUNK (1 << 20)       // bytes each thread checks per round of --check
+#define SOCKET_FILE "spell.sock"    // default socket for --serve and --client
+#define SERVER_LINE_MAX 65536       // longest request line --serve accepts
+#define SNAPSHOT_FILE "dictionary.bin"     // prebuilt trie + filter, rebuilt when dictionary changes
+#define SNAPSHOT_VERSION 9
+#define CONFIG_FILE "spell.conf"    // settings picked by mode 3, read at startup
+#define FREQ_FILE "frequency.txt"   // optional "word count" lines, used to rank suggestions
+#define USER_DICT_FILE "user_dictionary.txt"    // words added with --add, merged into the dictionary
+#define RELOAD_INTERVAL 2           // seconds between checks for changed dictionary files, 0 = never reload
+#define FREQ_SCALE 8                // stored frequency = 8 * log2(count + 1), capped at 255
+#define CHANNEL_EDIT_COST 64        // an edit costs as much as a 256x less frequent word
 
 // Bloom Filter variables
-#define FILTER_SIZE 10000000
-#define K 1     // no. of hash functions
+#define FILTER_FPR 0.01     // target false positive rate, size and no. of hash functions follow from it
+#define FILTER_K 0          // no. of hash functions, 0 = the optimum for FILTER_FPR
+#define FPR_SAMPLES 1000000 // non-words probed when measuring the false positive rate
+#define FILTER_BLOCKED 1    // 1 = all k bits of a word in one 64 byte cache line
+#define FILTER_LANES 8      // keys probed together by searchFilterLanes, one per 32-bit AVX2 lane
+#define LOOKUP_BATCH 256    // tokens deduplicated and looked up together by checkWordsBatch
+#define LOOKUP_LANES 8      // trie walks interleaved by checkWordsBatch
 
 // Trie variables
 #define MAX_LENGTH 50
 #define MAX_SUGGESTIONS 10
-#define MAX_INCRT_WORDS 1000
-#define CACHE_SIZE 100
+#define MAX_EDIT_DISTANCE 3
+#define COMPLETE_BLOCK 64       // word ids a completion query scans directly, larger ranges use the block table
+#define JW_MAX_LENGTH 64        // jaro winkler keeps match positions in 64-bit masks
+#define JW_PREFIX_LENGTH 4      // winkler prefix bonus: at most 4 letters, 0.1 each,
+#define JW_PREFIX_SCALE 0.1
+#define JW_BOOST_THRESHOLD 0.7  // only for pairs already this similar
+#define ENGINE_TRIE 0        // fuzzy walk over the trie
+#define ENGINE_BK_TREE 1     // BK-tree keyed on edit distance
+#define ENGINE_BUCKETS 2     // scan of the length buckets within the edit bound
+#define SUGGEST_ENGINE ENGINE_TRIE
+#define BUCKET_SAME_FIRST_LETTER 0  // 1 = bucket scan trusts the first letter, much faster but misses first letter typos
+#define CACHE_SIZE 4096     // misspellings whose suggestions are cached
+#define CACHE_SHARDS 16     // independently locked parts of the suggestion cache
 #define N 26    // no. of distinct characters in language
 
 #define INT_MAX 2147483647
 
 // MultiThreading variables
 #define N_THREADS 4
+#define READER_SLOTS 64     // cache lines the engine's readers register in, threads share them round robin
+
+// Tuning variables (mode 3)
+#define TUNE_FPR_SAMPLES 200000     // non-words probed per filter setting
+#define TUNE_MIN_SECONDS 0.2        // the corpus is rechecked until a setting has run this long
+#define TUNE_TOLERANCE 0.05         // settings this close to the fastest count as equally fast
+
+// Benchmark variables
+#define BENCH_WORDS 200000      // lookups timed per hit/miss mix
+#define BENCH_GROUP 64          // lookups timed together, one latency sample per group
+#define BENCH_QUERIES 300       // suggestion queries timed per edit distance
+#define COMPARE_REPEAT 100000   // mode 2 repeats each lookup this often to time it
 
 // Defining colors for formatting
 #define COLOR_BLUE "\x1b[34m"
@@ -40,12 +80,299 @@ int smallest(int a, int b, int c) {
     return a < b ? (a < c ? a : c) : (b < c ? b : c);
 }
 
+// Runtime settings: the compile time defaults above, replaced by whatever mode 3 saved in CONFIG_FILE
+typedef struct spell_config {
+    char dictPath[256];
+    char freqPath[256];
+    char userDictPath[256];
+    char snapshotPath[256];
+    double filterFpr;
+    int filterK;
+    int filterBlocked;
+    int cacheSize;
+    int threads;
+    int reloadInterval;
+} SPELL_CONFIG;
+
+SPELL_CONFIG defaultConfig(void) {
+    SPELL_CONFIG config = { DICT_FILE, FREQ_FILE, USER_DICT_FILE, SNAPSHOT_FILE, FILTER_FPR, FILTER_K, FILTER_BLOCKED, CACHE_SIZE, N_THREADS, RELOAD_INTERVAL };
+    return config;
+}
+
+// reads "key = value" lines over config, unknown keys and out of range values are ignored
+bool loadConfig(const char* path, SPELL_CONFIG* config) {
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL) return false;
+    char line[512], key[64], text[256];
+    double value;
+    while(fgets(line, sizeof(line), fp)) {
+        if(sscanf(line, " %63[a-z_] = %255s", key, text) != 2) continue;
+        value = atof(text);
+        if(!strcmp(key, "dictionary")) strcpy(config->dictPath, text);
+        else if(!strcmp(key, "frequencies")) strcpy(config->freqPath, text);
+        else if(!strcmp(key, "user_dictionary")) strcpy(config->userDictPath, text);
+        else if(!strcmp(key, "snapshot")) strcpy(config->snapshotPath, text);
+        else if(!strcmp(key, "filter_fpr") && value > 0 && value < 1) config->filterFpr = value;
+        else if(!strcmp(key, "filter_k") && value >= 0 && value <= 32) config->filterK = (int)value;
+        else if(!strcmp(key, "filter_blocked")) config->filterBlocked = value != 0;
+        else if(!strcmp(key, "cache_size") && value >= 1) config->cacheSize = (int)value;
+        else if(!strcmp(key, "threads") && value >= 1) config->threads = (int)value;
+        else if(!strcmp(key, "reload_interval") && value >= 0) config->reloadInterval = (int)value;
+    }
+    fclose(fp);
+    return true;
+}
+
+bool saveConfig(const char* path, const SPELL_CONFIG* config) {
+    FILE* fp = fopen(path, "w");
+    if(fp == NULL) {
+        perror(COLOR_RED "Error writing config" COLOR_RESET);
+        return false;
+    }
+    fprintf(fp, "# written by the optimisation mode, delete to go back to the defaults\n");
+    fprintf(fp, "dictionary = %s\nfrequencies = %s\nuser_dictionary = %s\nsnapshot = %s\n",
+            config->dictPath, config->freqPath, config->userDictPath, config->snapshotPath);
+    fprintf(fp, "filter_fpr = %g\nfilter_k = %d\nfilter_blocked = %d\ncache_size = %d\nthreads = %d\nreload_interval = %d\n",
+            config->filterFpr, config->filterK, config->filterBlocked, config->cacheSize, config->threads, config->reloadInterval);
+    return fclose(fp) == 0;
+}
+
+// Metrics: counters and latency histograms on the hot paths. Every thread records into a slot of
+// its own, so a hook is a plain add with no shared cache line, and dumping sums all the slots.
+// Histograms are HDR style, 16 buckets per power of two, so a quantile is off by at most 6.25%.
+// SPELL_METRICS 0 compiles every hook away (build with -DSPELL_METRICS=0).
+#ifndef SPELL_METRICS
+#define SPELL_METRICS 1
+#endif
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (61 << HIST_SUB_BITS)     // every uint64_t value has a bucket
+
+// the suggestion cache keeps its own counters, dumpMetrics exports a copy of them
+typedef struct cache_counts {
+    long hits, misses, evictions;
+} CACHE_COUNTS;
+
+enum metric_counter {
+    METRIC_LOOKUPS,             // words checked
+    METRIC_PROBES,              // of those, looked up after batch dedup
+    METRIC_FILTER_POSITIVES,    // probes the bloom filter let through
+    METRIC_TRIE_CONFIRMED,      // positives the trie confirmed, the rest were false positives
+    METRIC_TRIE_STEPS,          // slots tested by trie walks, steps / positives = lookup depth
+    METRIC_SUGGESTS,            // suggestion queries that ran an engine
+    METRIC_CANDIDATES,          // edit distances (DP rows for the trie walk) they computed
+    METRIC_RANKED,              // candidates within the bound, ranked against the top
+    METRIC_COMPLETES,           // prefix completion queries
+    METRIC_RELOADS,             // dictionaries swapped in by reloadEngine
+    METRIC_REQUESTS,            // server requests answered
+    METRIC_COUNTERS
+};
+
+const char* metric_counter_names[METRIC_COUNTERS] = {
+    "lookups", "probes", "filter_positives", "trie_confirmed", "trie_steps", "suggests",
+    "candidates", "ranked", "completes", "reloads", "requests"
+};
+
+enum metric_histogram {
+    HIST_LOOKUP_BATCH,          // checkWordsBlock call
+    HIST_SUGGEST,               // suggestion query that ran an engine
+    HIST_COMPLETE,              // prefix completion query
+    HIST_LOAD_PARSE,            // loadDictionary's parse of the word lists
+    HIST_LOAD_SHARDS,           // loadDictionary's filter and DAWG shards
+    HIST_LOAD_DOUBLE_ARRAY,     // buildDoubleArray
+    HIST_LOAD_SNAPSHOT,         // loadSnapshot, validation and mapping
+    HIST_SERVER_BATCH,          // one batch of server requests
+    HIST_SERVER_BATCH_SIZE,     // requests in it, the only histogram not in nanoseconds
+    METRIC_HISTOGRAMS
+};
+
+const char* metric_histogram_names[METRIC_HISTOGRAMS] = {
+    "lookup_batch", "suggest", "complete", "load_parse", "load_shards", "load_double_array", "load_snapshot",
+    "server_batch", "server_batch_size"
+};
+
+#if SPELL_METRICS
+typedef struct metrics_slot {
+    uint64_t counters[METRIC_COUNTERS];
+    uint64_t count[METRIC_HISTOGRAMS], sum[METRIC_HISTOGRAMS], max[METRIC_HISTOGRAMS];
+    uint64_t buckets[METRIC_HISTOGRAMS][HIST_BUCKETS];
+    struct metrics_slot* next;      // every slot ever created
+    struct metrics_slot* nextFree;  // slots of exited threads, handed to new ones with their counts kept
+} METRICS_SLOT;
+
+METRICS_SLOT* metrics_slots = NULL;
+METRICS_SLOT* metrics_free = NULL;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+pthread_key_t metrics_key;          // its destructor frees the slot of an exiting thread
+__thread METRICS_SLOT* metrics_slot = NULL;
+
+void releaseMetricsSlot(void* arg) {
+    METRICS_SLOT* slot = (METRICS_SLOT*)arg;
+    pthread_mutex_lock(&metrics_lock);
+    slot->nextFree = metrics_free;
+    metrics_free = slot;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void createMetricsKey(void) {
+    pthread_key_create(&metrics_key, releaseMetricsSlot);
+}
+
+METRICS_SLOT* claimMetricsSlot(void) {
+    pthread_once(&metrics_once, createMetricsKey);
+    pthread_mutex_lock(&metrics_lock);
+    METRICS_SLOT* slot = metrics_free;
+    if(slot) metrics_free = slot->nextFree;
+    else {
+        slot = (METRICS_SLOT*)calloc(1, sizeof(METRICS_SLOT));
+        slot->next = metrics_slots;
+        metrics_slots = slot;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_setspecific(metrics_key, slot);
+    return metrics_slot = slot;
+}
+
+METRICS_SLOT* metricsSlot(void) {
+    return metrics_slot ? metrics_slot : claimMetricsSlot();
+}
+
+// only the owner writes a slot, relaxed atomics keep the dump's concurrent reads well defined
+void metricAdd(uint64_t* value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+uint64_t metricsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// values below 16 get a bucket each, above that a power of two is split into 16
+int histogramBucket(uint64_t value) {
+    if(value < (1 << HIST_SUB_BITS)) return value;
+    int e = 63 - __builtin_clzll(value);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | ((value >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+uint64_t histogramBucketLow(int bucket) {
+    if(bucket < (1 << HIST_SUB_BITS)) return bucket;
+    int e = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    return (uint64_t)((1 << HIST_SUB_BITS) | (bucket & ((1 << HIST_SUB_BITS) - 1))) << (e - HIST_SUB_BITS);
+}
+
+void recordHistogram(int histogram, uint64_t value) {
+    METRICS_SLOT* slot = metricsSlot();
+    metricAdd(&slot->buckets[histogram][histogramBucket(value)], 1);
+    metricAdd(&slot->count[histogram], 1);
+    metricAdd(&slot->sum[histogram], value);
+    if(value > slot->max[histogram]) __atomic_store_n(&slot->max[histogram], value, __ATOMIC_RELAXED);
+}
+
+// the lookup counters move together, one slot fetch covers all five
+void recordLookups(uint64_t lookups, uint64_t probes, uint64_t positives, uint64_t confirmed, uint64_t steps) {
+    uint64_t* counters = metricsSlot()->counters;
+    metricAdd(&counters[METRIC_LOOKUPS], lookups);
+    metricAdd(&counters[METRIC_PROBES], probes);
+    metricAdd(&counters[METRIC_FILTER_POSITIVES], positives);
+    metricAdd(&counters[METRIC_TRIE_CONFIRMED], confirmed);
+    metricAdd(&counters[METRIC_TRIE_STEPS], steps);
+}
+
+#define METRIC_ADD(counter, n) metricAdd(&metricsSlot()->counters[counter], (n))
+#define METRIC_LOOKUPS_DONE(lookups, probes, positives, confirmed, steps) recordLookups(lookups, probes, positives, confirmed, steps)
+#define METRIC_RECORD(histogram, value) recordHistogram(histogram, (value))
+#define METRIC_TIMER(name) uint64_t name = metricsNow()
+#define METRIC_ELAPSED(histogram, timer) recordHistogram(histogram, metricsNow() - (timer))
+
+// sums every slot into total, threads keep recording meanwhile
+void collectMetrics(METRICS_SLOT* total) {
+    memset(total, 0, sizeof(METRICS_SLOT));
+    pthread_mutex_lock(&metrics_lock);
+    for(METRICS_SLOT* slot = metrics_slots; slot; slot = slot->next) {
+        for(int c=0; c<METRIC_COUNTERS; c++) total->counters[c] += __atomic_load_n(&slot->counters[c], __ATOMIC_RELAXED);
+        for(int h=0; h<METRIC_HISTOGRAMS; h++) {
+            total->count[h] += __atomic_load_n(&slot->count[h], __ATOMIC_RELAXED);
+            total->sum[h] += __atomic_load_n(&slot->sum[h], __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&slot->max[h], __ATOMIC_RELAXED);
+            if(max > total->max[h]) total->max[h] = max;
+            for(int b=0; b<HIST_BUCKETS; b++) total->buckets[h][b] += __atomic_load_n(&slot->buckets[h][b], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+// highest value of the bucket holding quantile q, never above the largest value recorded
+uint64_t histogramQuantile(const METRICS_SLOT* total, int histogram, double q) {
+    uint64_t rank = (uint64_t)ceil(q * total->count[histogram]), seen = 0;
+    for(int b=0; b<HIST_BUCKETS; b++) {
+        seen += total->buckets[histogram][b];
+        if(seen >= rank && seen > 0) {
+            uint64_t high = b + 1 < HIST_BUCKETS ? histogramBucketLow(b + 1) - 1 : total->max[histogram];
+            return high < total->max[histogram] ? high : total->max[histogram];
+        }
+    }
+    return 0;
+}
+
+// JSON on a single line (the server's reply to "metrics"), or Prometheus text ending in a blank line.
+// cache, when given, adds the counters of a suggestion cache; they restart with each reloaded dictionary
+void dumpMetrics(FILE* out, bool prometheus, const CACHE_COUNTS* cache) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char* quantile_names[] = { "p50", "p90", "p99", "p999" };
+    METRICS_SLOT* total = (METRICS_SLOT*)malloc(sizeof(METRICS_SLOT));
+    collectMetrics(total);
+    if(prometheus) {
+        for(int c=0; c<METRIC_COUNTERS; c++)
+            fprintf(out, "# TYPE spell_%s_total counter\nspell_%s_total %llu\n",
+                    metric_counter_names[c], metric_counter_names[c], (unsigned long long)total->counters[c]);
+        if(cache)
+            fprintf(out, "# TYPE spell_cache_hits_total counter\nspell_cache_hits_total %ld\n# TYPE spell_cache_misses_total counter\nspell_cache_misses_total %ld\n"
+                    "# TYPE spell_cache_evictions_total counter\nspell_cache_evictions_total %ld\n", cache->hits, cache->misses, cache->evictions);
+        for(int h=0; h<METRIC_HISTOGRAMS; h++) {
+            // Prometheus wants seconds
+            double scale = h == HIST_SERVER_BATCH_SIZE ? 1 : 1e-9;
+            const char* name = metric_histogram_names[h];
+            const char* unit = h == HIST_SERVER_BATCH_SIZE ? "" : "_seconds";
+            fprintf(out, "# TYPE spell_%s%s summary\n", name, unit);
+            for(size_t q=0; q<sizeof(quantiles)/sizeof(quantiles[0]); q++)
+                fprintf(out, "spell_%s%s{quantile=\"%g\"} %g\n", name, unit, quantiles[q], histogramQuantile(total, h, quantiles[q]) * scale);
+            fprintf(out, "spell_%s%s_sum %g\nspell_%s%s_count %llu\n", name, unit, total->sum[h] * scale, name, unit, (unsigned long long)total->count[h]);
+        }
+        fprintf(out, "\n");
+    }
+    else {
+        fprintf(out, "{\"counters\": {");
+        for(int c=0; c<METRIC_COUNTERS; c++)
+            fprintf(out, "%s\"%s\": %llu", c ? ", " : "", metric_counter_names[c], (unsigned long long)total->counters[c]);
+        if(cache) fprintf(out, ", \"cache_hits\": %ld, \"cache_misses\": %ld, \"cache_evictions\": %ld", cache->hits, cache->misses, cache->evictions);
+        fprintf(out, "}, \"histograms\": {");
+        for(int h=0; h<METRIC_HISTOGRAMS; h++) {
+            fprintf(out, "%s\"%s%s\": {\"count\": %llu, \"sum\": %llu, \"max\": %llu", h ? ", " : "", metric_histogram_names[h],
+                    h == HIST_SERVER_BATCH_SIZE ? "" : "_ns", (unsigned long long)total->count[h],
+                    (unsigned long long)total->sum[h], (unsigned long long)total->max[h]);
+            for(size_t q=0; q<sizeof(quantiles)/sizeof(quantiles[0]); q++)
+                fprintf(out, ", \"%s\": %llu", quantile_names[q], (unsigned long long)histogramQuantile(total, h, quantiles[q]));
+            fprintf(out, "}");
+        }
+        fprintf(out, "}}\n");
+    }
+    free(total);
+}
+#else
+#define METRIC_ADD(counter, n) ((void)(n))
+#define METRIC_LOOKUPS_DONE(lookups, probes, positives, confirmed, steps) ((void)(confirmed), (void)(steps))
+#define METRIC_RECORD(histogram, value) ((void)(value))
+#define METRIC_TIMER(name)
+#define METRIC_ELAPSED(histogram, timer) ((void)0)
+#endif
+
 // hash functions
 uint32_t djb2(const char* string) {     // DJB_2 Hash
     uint32_t hash = 5381;
     int c;
     while ((c= *string++)) hash = (hash << 5) + hash + c;    // hash*33 + c
-    return hash % FILTER_SIZE;
+    return hash;
 }
 
 uint32_t jenkin(const char* str) {      // Jenkin's Hash
@@ -58,359 +385,3374 @@ uint32_t jenkin(const char* str) {      // Jenkin's Hash
     hash += (hash << 3);
     hash ^= (hash >> 11);
     hash += (hash << 15);
-    return hash % FILTER_SIZE;
+    return hash;
 }
 
-// Bloom Filter functions
-void insertFilter(bool* filter, char* word) {    // bloom filter insertion
-    for(int i=0; i<K; i++) filter[(djb2(word)*i + jenkin(word))%FILTER_SIZE] = 1;
+// Bloom Filter functions: bit packed, k probes by double hashing (Kirsch-Mitzenmacher).
+// A blocked filter first picks one 512 bit block (a cache line) and keeps all k probes inside it.
+typedef struct bloom_filter {
+    uint64_t* bits;
+    uint64_t nBits;
+    int k;              // no. of hash functions
+    double fpr;         // false positive rate it was sized for
+    bool blocked;
+    bool mapped;        // bits point into a read only snapshot mapping
+} BLOOM_FILTER;
+
+// bits for nItems words at the given false positive rate, in whole cache lines
+uint64_t filterBits(uint64_t nItems, double fpr) {
+    if(nItems == 0) nItems = 1;
+    double nBits = ceil(-(double)nItems * log(fpr) / (log(2) * log(2)));
+    return ((uint64_t)nBits + 511) & ~(uint64_t)511;
 }
 
-bool searchFilter(bool* filter, char* word) {      // searching in bloom filter
-    for(int i=0; i<K; i++) if(!filter[(djb2(word)*i + jenkin(word))%FILTER_SIZE]) return false;
-    return true;
+int optimalHashes(uint64_t nItems, double fpr) {
+    if(nItems == 0) nItems = 1;
+    return greater(1, (int)round((double)filterBits(nItems, fpr) / nItems * log(2)));
 }
 
-// Trie functions
-typedef struct node {   // trie node
-    struct node *child[26];
-    bool isEOW;
-} TRIE_NODE;
+// sizes the filter for nItems words at the given false positive rate, k <= 0 picks the optimal k
+BLOOM_FILTER* createFilter(uint64_t nItems, double fpr, int k, bool blocked) {
+    BLOOM_FILTER* filter = (BLOOM_FILTER*)malloc(sizeof(BLOOM_FILTER));
+    filter->nBits = filterBits(nItems, fpr);
+    filter->k = k > 0 ? k : optimalHashes(nItems, fpr);
+    filter->fpr = fpr;
+    filter->bits = (uint64_t*)aligned_alloc(64, filter->nBits / 8);
+    memset(filter->bits, 0, filter->nBits / 8);
+    filter->blocked = blocked;
+    filter->mapped = false;
+    return filter;
+}
 
-TRIE_NODE* createNode() {
-    TRIE_NODE* pNode = (TRIE_NODE*)malloc(sizeof(TRIE_NODE));
-    pNode->isEOW = false;
-    for(int i=0; i<26; i++) pNode->child[i] = NULL;
-    return pNode;
+void freeFilter(BLOOM_FILTER* filter) {
+    if(!filter->mapped) free(filter->bits);
+    free(filter);
+}
+
+// 512 bit mask of the k probes of a word (given its djb2 and jenkin hashes) inside its block, returns the block
+const uint64_t* blockMaskHash(const BLOOM_FILTER* filter, uint64_t h1, uint64_t h2, uint64_t mask[8]) {
+    uint64_t nBlocks = filter->nBits / 512;
+    uint64_t step = (h1 / nBlocks) | 1;     // bits of h1 not used to pick the block
+    memset(mask, 0, 8 * sizeof(uint64_t));
+    for(int i=0; i<filter->k; i++) {
+        uint64_t bit = (h2 + i*step) & 511;
+        mask[bit >> 6] |= 1ULL << (bit & 63);
+    }
+    return filter->bits + (h1 % nBlocks) * 8;
+}
+
+const uint64_t* blockMaskFilter(const BLOOM_FILTER* filter, const char* word, uint64_t mask[8]) {
+    return blockMaskHash(filter, djb2(word), jenkin(word), mask);
+}
+
+// true when every bit of mask is set in block
+bool blockContains(const uint64_t* block, const uint64_t* mask) {
+#ifdef __AVX2__
+    __m256i b0 = _mm256_load_si256((const __m256i*)block), b1 = _mm256_load_si256((const __m256i*)(block + 4));
+    __m256i m0 = _mm256_loadu_si256((const __m256i*)mask), m1 = _mm256_loadu_si256((const __m256i*)(mask + 4));
+    return _mm256_testc_si256(b0, m0) & _mm256_testc_si256(b1, m1);
+#else
+    uint64_t missing = 0;
+    for(int i=0; i<8; i++) missing |= mask[i] & ~block[i];
+    return missing == 0;
+#endif
+}
+
+void insertFilter(BLOOM_FILTER* filter, const char* word) {    // bloom filter insertion
+    if(filter->blocked) {
+        uint64_t mask[8];
+        uint64_t* block = (uint64_t*)blockMaskFilter(filter, word, mask);
+        for(int i=0; i<8; i++) block[i] |= mask[i];
+        return;
+    }
+    uint64_t h1 = djb2(word), h2 = jenkin(word) | 1;    // odd step so probes never collapse onto h1
+    for(int i=0; i<filter->k; i++) {
+        uint64_t bit = (h1 + i*h2) % filter->nBits;
+        filter->bits[bit >> 6] |= 1ULL << (bit & 63);
+    }
 }
 
-void insertTrie(TRIE_NODE* root, char* word){
-    TRIE_NODE* pCrawl = root;
-    int len = strlen(word), idx;
-    for(int i=0; i<len; i++) {
-        idx = word[i] - 'a';
-        if(!pCrawl->child[idx]) pCrawl->child[idx] = createNode();
-        pCrawl = pCrawl->child[idx];
+// insertFilter for filters several threads fill at once
+void insertFilterShared(BLOOM_FILTER* filter, const char* word) {
+    if(filter->blocked) {
+        uint64_t mask[8];
+        uint64_t* block = (uint64_t*)blockMaskFilter(filter, word, mask);
+        for(int i=0; i<8; i++) if(mask[i]) __atomic_fetch_or(&block[i], mask[i], __ATOMIC_RELAXED);
+        return;
+    }
+    uint64_t h1 = djb2(word), h2 = jenkin(word) | 1;
+    for(int i=0; i<filter->k; i++) {
+        uint64_t bit = (h1 + i*h2) % filter->nBits;
+        __atomic_fetch_or(&filter->bits[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
     }
-    pCrawl->isEOW = true;
 }
 
-bool searchTrie(TRIE_NODE* root, char* word){
-    TRIE_NODE* pCrawl = root;
-    int len = strlen(word), idx;
-    for(int i=0; i<len; i++) {
-        idx = word[i] - 'a';
-        if(!pCrawl->child[idx]) return false;
-        pCrawl = pCrawl->child[idx];
+// filter lookup from already computed djb2 and jenkin hashes
+bool searchFilterHash(const BLOOM_FILTER* filter, uint64_t h1, uint64_t h2) {
+    if(filter->blocked) {
+        uint64_t mask[8];
+        return blockContains(blockMaskHash(filter, h1, h2, mask), mask);
+    }
+    h2 |= 1;
+    for(int i=0; i<filter->k; i++) {
+        uint64_t bit = (h1 + i*h2) % filter->nBits;
+        if(!(filter->bits[bit >> 6] & (1ULL << (bit & 63)))) return false;
     }
-    return (pCrawl->isEOW);
+    return true;
+}
+
+bool searchFilter(const BLOOM_FILTER* filter, const char* word) {      // searching in bloom filter
+    return searchFilterHash(filter, djb2(word), jenkin(word));
 }
 
-void display(TRIE_NODE* root, char* word, int level){
-    if(root->isEOW) word[level] = '\0';
-    for(int i=0; i<26; i++){
-        if(root->child[i]!=NULL) {
-            word[level] = i + 'a';
-            display(root->child[i], word, level+1);
+// Multi-key probe of a blocked filter: key i's k bits sit at (h2[i] + j*step[i]) & 511 inside block
+// block[i], the same bits blockMaskHash sets. found[i] is set when all of them are.
+void searchFilterLanesScalar(const BLOOM_FILTER* filter, const uint32_t* block, const uint32_t* h2, const uint32_t* step, int n, bool* found) {
+    for(int i=0; i<n; i++) {
+        const uint64_t* bits = filter->bits + (size_t)block[i] * 8;
+        bool all = true;
+        for(int j=0; j<filter->k && all; j++) {
+            uint32_t bit = (h2[i] + j * step[i]) & 511;
+            all = (bits[bit >> 6] >> (bit & 63)) & 1;
         }
+        found[i] = all;
     }
 }
 
-void* filterThread(void* filter) {
-    char word[50];      // maximum word lenght
-    FILE* dict_ptr = fopen(DICT_FILE, "r");
-    if(dict_ptr == NULL) {
-        perror(COLOR_RED "Error loading Dictionary\n" COLOR_RESET);
-        exit(1);
+#if defined(__x86_64__) || defined(__i386__)
+// FILTER_LANES keys per pass, one per 32-bit AVX2 lane: each probe gathers one 32-bit word from
+// every key's block and tests its bit, so the k probes of 8 keys take k gathers instead of 8k loads.
+// Compiled for AVX2 whatever the build flags; searchFilterLanes only calls it on CPUs that have it.
+__attribute__((target("avx2")))
+void searchFilterLanesAvx2(const BLOOM_FILTER* filter, const uint32_t* block, const uint32_t* h2, const uint32_t* step, int n, bool* found) {
+    const __m256i bit_mask = _mm256_set1_epi32(511), shift_mask = _mm256_set1_epi32(31), one = _mm256_set1_epi32(1);
+    for(int start=0; start<n; start+=FILTER_LANES) {
+        int count = smaller(FILTER_LANES, n - start);
+        uint32_t lane_block[FILTER_LANES] = { 0 }, lane_h2[FILTER_LANES] = { 0 }, lane_step[FILTER_LANES] = { 0 };
+        memcpy(lane_block, block + start, count * sizeof(uint32_t));     // idle lanes probe block 0, their result is dropped
+        memcpy(lane_h2, h2 + start, count * sizeof(uint32_t));
+        memcpy(lane_step, step + start, count * sizeof(uint32_t));
+        __m256i base = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i*)lane_block), 4);     // in 32-bit words
+        __m256i pos = _mm256_loadu_si256((const __m256i*)lane_h2), inc = _mm256_loadu_si256((const __m256i*)lane_step);
+        __m256i all = _mm256_set1_epi32(-1);
+        for(int j=0; j<filter->k; j++) {
+            __m256i bit = _mm256_and_si256(pos, bit_mask);
+            __m256i word = _mm256_i32gather_epi32((const int*)filter->bits, _mm256_add_epi32(base, _mm256_srli_epi32(bit, 5)), 4);
+            __m256i want = _mm256_sllv_epi32(one, _mm256_and_si256(bit, shift_mask));
+            all = _mm256_and_si256(all, _mm256_cmpeq_epi32(_mm256_and_si256(word, want), want));
+            if(_mm256_testz_si256(all, all)) break;     // every key already ruled out
+            pos = _mm256_add_epi32(pos, inc);
+        }
+        int hits = _mm256_movemask_ps(_mm256_castsi256_ps(all));
+        for(int i=0; i<count; i++) found[start + i] = (hits >> i) & 1;
     }
-    while(fscanf(dict_ptr, "%s", word) != EOF) insertFilter((bool*) filter, word);
-    printf(COLOR_GREEN "Dictionary loaded on filter successfully\n" COLOR_RESET);
-    return NULL;
 }
+#endif
 
-void* trieThread(void* root) {
-    char word[50];      // maximum word lenght
-    FILE* dict_ptr = fopen(DICT_FILE, "r");
-    if(dict_ptr == NULL) {
-        perror(COLOR_RED "Error loading Dictionary or wrong path/file for dictionary\n" COLOR_RESET);
-        exit(1);
+// picks the AVX2 probe when the CPU has it and the filter's 32-bit word indices fit a lane
+void searchFilterLanes(const BLOOM_FILTER* filter, const uint32_t* block, const uint32_t* h2, const uint32_t* step, int n, bool* found) {
+#if defined(__x86_64__) || defined(__i386__)
+    if(__builtin_cpu_supports("avx2") && filter->nBits / 32 <= INT32_MAX) {
+        searchFilterLanesAvx2(filter, block, h2, step, n, found);
+        return;
     }
-    while(fscanf(dict_ptr, "%s", word) != EOF) insertTrie((TRIE_NODE*) root, word);
-    printf(COLOR_GREEN "Dictionary loaded on trie successfully\n" COLOR_RESET);
-    return NULL;
+#endif
+    searchFilterLanesScalar(filter, block, h2, step, n, found);
 }
 
-// populating bloom filter and trie with Dictionary words
-void loadDictionary(bool* filter, TRIE_NODE* root) {
-    pthread_t filter_thread, trie_thread;
-    if(pthread_create(&filter_thread, NULL, filterThread, filter) & pthread_create(&trie_thread, NULL, trieThread, root)) printf(COLOR_RED "Error occured in threading\n" COLOR_RESET);
-    if(pthread_join(filter_thread, NULL) & pthread_join(trie_thread, NULL)) printf(COLOR_RED "Error occured in threading\n" COLOR_RESET);
+size_t sizeFilter(const BLOOM_FILTER* filter) {
+    return sizeof(BLOOM_FILTER) + filter->nBits / 8;
 }
 
-int levenshteinDistance(const char *s, const char *t){
-    int n = strlen(s);
-    int m = strlen(t);
+// Arena allocator: objects are bumped out of large blocks and all released at once.
+// An arena is not thread safe, each one is filled by a single thread.
+#define ARENA_BLOCK_SIZE (1 << 20)
 
-    if (n == 0)
-        return m;
-    if (m == 0)
-        return n;
+typedef struct arena_block {
+    struct arena_block* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ARENA_BLOCK;
 
-    int dp[MAX_LENGTH + 1][MAX_LENGTH + 1];
-    for (int i = 0; i <= n; i++)
-        dp[i][0] = i;
-    for (int j = 0; j <= m; j++)
-        dp[0][j] = j;
+typedef struct arena {
+    ARENA_BLOCK* head;
+    void* freeList;     // recycled objects, only for arenas holding a single object size
+} ARENA;
 
-    for (int i = 1; i <= n; i++)
-    {
-        for (int j = 1; j <= m; j++)
-        {
-            int cost = (s[i - 1] == t[j - 1]) ? 0 : 1;
-            dp[i][j] = smallest(dp[i - 1][j] + 1, dp[i][j - 1] + 1, dp[i - 1][j - 1] + cost);
+void* arenaAlloc(ARENA* arena, size_t size) {
+    if(arena->freeList) {
+        void* ptr = arena->freeList;
+        arena->freeList = *(void**)ptr;
+        return ptr;
+    }
+    size = (size + 7) & ~(size_t)7;       // keep every object 8 byte aligned
+    if(!arena->head || arena->head->used + size > arena->head->size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ARENA_BLOCK* block = (ARENA_BLOCK*)malloc(sizeof(ARENA_BLOCK) + blockSize);
+        if(block == NULL) {
+            perror(COLOR_RED "Error allocating arena block\n" COLOR_RESET);
+            exit(1);
         }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = blockSize;
+        arena->head = block;
     }
-    return dp[n][m];
+    void* ptr = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    return ptr;
 }
 
-double jaroWinklerDistance(char* s1, char* s2){
-    if (s1 == s2)
-        return 1.0;
+// hands an object back for reuse by the next arenaAlloc of the same size
+void arenaRecycle(ARENA* arena, void* ptr) {
+    *(void**)ptr = arena->freeList;
+    arena->freeList = ptr;
+}
 
-    int len1 = strlen(s1), len2 = strlen(s2);
-    int max_dist = floor(greater(len1, len2) / 2) - 1;
-    int match = 0;
- 
-    int* hash_s1 = calloc(len1, sizeof(int));
-    int* hash_s2 = calloc(len2, sizeof(int));
- 
-    for(int i=0; i<len1; i++) {
-        for(int j=greater(0, i - max_dist);
-             j<smaller(len2, i + max_dist + 1); j++)
-            if (s1[i] == s2[j] && hash_s2[j] == 0) {
-                hash_s1[i] = 1;
-                hash_s2[j] = 1;
-                match++;
-                break;
-            }
+void arenaFree(ARENA* arena) {
+    while(arena->head) {
+        ARENA_BLOCK* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
-    if (match == 0) return 0.0;
-    
-    double t = 0; 
-    int point = 0;
-
-    for(int i=0; i < len1; i++)
-        if(hash_s1[i]) {
-            while(hash_s2[point] == 0) point++;
-            if(s1[i] != s2[point++]) t++;
-        }
-
-    t /= 2;
-    return (((double)match) / ((double)len1) + ((double)match) / ((double)len2) + ((double)match - t) / ((double)match)) / 3.0;
+    arena->freeList = NULL;
 }
 
-struct LRUCacheQueueNode{
-    char val[100];
-    struct LRUCacheQueueNode* prev;
-    struct LRUCacheQueueNode* forw;
-};
+size_t arenaSize(ARENA* arena) {
+    size_t size = 0;
+    for(ARENA_BLOCK* block = arena->head; block; block = block->next) size += block->size;
+    return size;
+}
 
-struct LRUCacheMapNode{
-    struct LRUCacheQueueNode* nd;
-    struct LRUCacheMapNode* prev;
-    struct LRUCacheMapNode* forw;
-};
+// Trie functions
+typedef struct node {   // trie node
+    struct node *child[26];
+    int state;          // double-array state once placed, -1 before
+    int count;          // no. of words below, set when placed
+    bool isEOW;
+} TRIE_NODE;
 
-struct LRUCacheQueueNode* createQueueNode(char* string) {
-    struct LRUCacheQueueNode* ans = (struct LRUCacheQueueNode*)malloc(sizeof(struct LRUCacheQueueNode));
-    strcpy(ans->val, string);
-    ans->forw = NULL;
-    ans->prev = NULL;
-    return ans;
+TRIE_NODE* createNode(ARENA* arena) {
+    TRIE_NODE* pNode = (TRIE_NODE*)arenaAlloc(arena, sizeof(TRIE_NODE));
+    pNode->isEOW = false;
+    pNode->state = -1;
+    pNode->count = 0;
+    for(int i=0; i<26; i++) pNode->child[i] = NULL;
+    return pNode;
 }
 
-struct LRUCacheMapNode* createHashNode(char* string){
-    struct LRUCacheMapNode* ans=(struct LRUCacheMapNode*)malloc(sizeof(struct LRUCacheMapNode));
-    ans->nd=createQueueNode(string);
-    ans->prev=NULL;
-    ans->forw=NULL;
-    return ans;
-}
+// DAWG minimization (Daciuk et al.): words are added in sorted order, and as soon as a word
+// leaves a branch for good, that branch's nodes are replaced bottom up by an equivalent node
+// already in the register (same end of word flag, same children) or registered themselves.
+// Suffixes like -ing or -ness then end up stored once for the whole dictionary.
+// The register is split into independently locked stripes so first letter shards can share it.
+#define REGISTER_STRIPES 64
 
-struct LRUCacheMap{
-    struct LRUCacheMapNode** arr;
-};
+typedef struct node_register {
+    pthread_mutex_t lock;
+    TRIE_NODE** slots;
+    size_t size, n;
+} NODE_REGISTER;
 
-struct LRUCache{
-    struct LRUCacheQueueNode *head, *tail;
-    struct LRUCacheMapNode** map;
-    int size;
-    int maxSize;
-};
+NODE_REGISTER* createRegister(void) {
+    NODE_REGISTER* reg = (NODE_REGISTER*)calloc(REGISTER_STRIPES, sizeof(NODE_REGISTER));
+    for(int i=0; i<REGISTER_STRIPES; i++) pthread_mutex_init(&reg[i].lock, NULL);
+    return reg;
+}
 
-struct LRUCache* createLRUCache(int sz){
-    struct LRUCache* res=(struct LRUCache*)malloc(sizeof(struct LRUCache));
-    res->map=(struct LRUCacheMapNode**)malloc(sizeof(struct LRUCacheMapNode*)*sz);
-    for (int i=0; i<sz; i++) res->map[i]=NULL;
-    res->size=0;
-    res->maxSize=sz;
-    res->head=createQueueNode("");
-    res->tail=createQueueNode("");
-    res->head->forw=res->tail;
-    res->tail->prev=res->head;
-    return res;
-};
+void freeRegister(NODE_REGISTER* reg) {
+    for(int i=0; i<REGISTER_STRIPES; i++) {
+        pthread_mutex_destroy(&reg[i].lock);
+        free(reg[i].slots);
+    }
+    free(reg);
+}
 
-void insert(struct LRUCache* obj, struct LRUCacheQueueNode* nd){
-    nd->prev = obj->head;
-    nd->forw = obj->head->forw;
-    obj->head->forw->prev = nd;
-    obj->head->forw = nd;
+// children are registered before their parent, so comparing their addresses compares subtrees
+uint64_t hashTrieNode(const TRIE_NODE* node) {
+    uint64_t hash = node->isEOW;
+    for(int i=0; i<26; i++) hash = (hash ^ (uintptr_t)node->child[i]) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
 }
 
-struct LRUCacheQueueNode* deleteQueue(struct LRUCache* obj){
-    struct LRUCacheQueueNode* previousNode = obj->tail->prev;
-    previousNode->prev->forw = obj->tail;
-    obj->tail->prev = previousNode->prev;
-    return previousNode;
+bool sameTrieNode(const TRIE_NODE* a, const TRIE_NODE* b) {
+    return a->isEOW == b->isEOW && !memcmp(a->child, b->child, sizeof(a->child));
 }
 
-void deleteHsh(struct LRUCache* obj, struct LRUCacheQueueNode* QNode){
-    int ind=djb2(QNode->val)%(obj->maxSize);
-    struct LRUCacheMapNode* temp=obj->map[ind];
-    while (temp->nd!=QNode) temp=temp->forw;
-    if (obj->map[ind]==temp) obj->map[ind]=temp->forw;
-    else{
-        temp->prev->forw=temp->forw;
-        if (temp->forw!=NULL) temp->forw->prev=temp->prev;
+// returns the registered node equivalent to node, registering node itself when there is none
+TRIE_NODE* registerTrieNode(NODE_REGISTER* reg, TRIE_NODE* node) {
+    uint64_t hash = hashTrieNode(node);
+    NODE_REGISTER* stripe = &reg[hash % REGISTER_STRIPES];
+    hash /= REGISTER_STRIPES;
+    pthread_mutex_lock(&stripe->lock);
+    if(2 * (stripe->n + 1) > stripe->size) {
+        size_t oldSize = stripe->size;
+        TRIE_NODE** old = stripe->slots;
+        stripe->size = oldSize ? 2 * oldSize : 1024;
+        stripe->slots = (TRIE_NODE**)calloc(stripe->size, sizeof(TRIE_NODE*));
+        for(size_t i=0; i<oldSize; i++) {
+            if(!old[i]) continue;
+            size_t slot = (hashTrieNode(old[i]) / REGISTER_STRIPES) & (stripe->size - 1);
+            while(stripe->slots[slot]) slot = (slot + 1) & (stripe->size - 1);
+            stripe->slots[slot] = old[i];
+        }
+        free(old);
     }
-    free(temp);
+    size_t slot = hash & (stripe->size - 1);
+    while(stripe->slots[slot] && !sameTrieNode(stripe->slots[slot], node)) slot = (slot + 1) & (stripe->size - 1);
+    if(!stripe->slots[slot]) {
+        stripe->slots[slot] = node;
+        stripe->n++;
+    }
+    TRIE_NODE* same = stripe->slots[slot];
+    pthread_mutex_unlock(&stripe->lock);
+    return same;
 }
 
-void lRUCachePut(struct LRUCache* obj, char* string) {
-    int ind=djb2(string)%(obj->maxSize);
-    
-    if (obj->map[ind]!=NULL){
-        struct LRUCacheMapNode* temp=obj->map[ind];
-        obj->map[ind]=createHashNode(string);
-        obj->map[ind]->forw=temp;
-        temp->prev=obj->map[ind];
+// replace_or_register: minimizes the branch of the most recently added (last) child of node
+void minimizeLastChild(NODE_REGISTER* reg, ARENA* arena, TRIE_NODE* node) {
+    int last = 25;
+    while(last >= 0 && !node->child[last]) last--;
+    if(last < 0) return;
+    TRIE_NODE* child = node->child[last];
+    minimizeLastChild(reg, arena, child);
+    TRIE_NODE* same = registerTrieNode(reg, child);
+    if(same != child) {
+        node->child[last] = same;
+        arenaRecycle(arena, child);
     }
-    else{
-        obj->map[ind]=createHashNode(string);
+}
+
+// adds word (sorted after every word added before it) below root, path holds the nodes of the
+// previous word's letters and prevLen its length; root's branches still need a final minimizeLastChild
+void insertDawg(NODE_REGISTER* reg, ARENA* arena, TRIE_NODE* root, TRIE_NODE** path, const char* prev, int prevLen, const char* word, int len) {
+    int common = 0;
+    path[0] = root;
+    while(common < prevLen && common < len && prev[common] == word[common]) common++;
+    minimizeLastChild(reg, arena, path[common]);
+    for(int i=common; i<len; i++) {
+        path[i+1] = createNode(arena);
+        path[i]->child[word[i] - 'a'] = path[i+1];
     }
-    insert(obj, obj->map[ind]->nd);
-    if (obj->size<obj->maxSize) obj->size++;
-    else{
-        struct LRUCacheQueueNode* QNode=deleteQueue(obj);
-        deleteHsh(obj, QNode);
-        free(QNode);
+    path[len]->isEOW = true;
+}
+
+// Double-array DAWG: the minimized word graph stored in flat arrays. A state is identified by its
+// base b, and no two states share one, so a one byte label is enough to tell whose slot is whose:
+// the transition of state b on code c is slot b + c, valid only when label[b + c] == c + 1.
+// Letters use codes 1..26, code 0 marks a state where a word ends. next[t] is the state slot t
+// leads to. Paths no longer identify words once states are shared, so rank[t] counts the words
+// that sort before the ones reached through t from its state; a word's id (its alphabetical
+// index) is the sum of rank along its path.
+typedef struct double_array {
+    uint8_t* label;     // 0 = free slot
+    int* next;
+    int* rank;
+    int size;           // no. of allocated slots
+    int root;
+    int nStates;
+    int nWords;
+    int nextCheck;      // build only: slots below this are (almost) all used
+    uint8_t* baseUsed;  // build only: bases already given to a state
+    bool mapped;        // arrays point into a read only snapshot mapping
+    void* mapping;      // that mapping, released with the trie
+    size_t mappingSize;
+    uint8_t* freq;      // quantized log frequency per word id, NULL without a frequency file
+    int maxFreq;
+    uint16_t* score;    // completion score per word id, see rankCompletions
+    int* best;          // best scored id per block of ids and per run of 2^p blocks
+    int nBlocks;
+} DA_TRIE;
+
+void growDoubleArray(DA_TRIE* da, int size) {
+    if(size <= da->size) return;
+    int newSize = da->size;
+    while(newSize < size) newSize *= 2;
+    da->label = (uint8_t*)realloc(da->label, newSize);
+    da->next = (int*)realloc(da->next, newSize * sizeof(int));
+    da->rank = (int*)realloc(da->rank, newSize * sizeof(int));
+    da->baseUsed = (uint8_t*)realloc(da->baseUsed, newSize);
+    memset(da->label + da->size, 0, newSize - da->size);
+    memset(da->baseUsed + da->size, 0, newSize - da->size);
+    for(int i=da->size; i<newSize; i++) da->next[i] = da->rank[i] = 0;
+    da->size = newSize;
+}
+
+// finds an unused base where every code in codes lands on a free slot
+int findBaseDoubleArray(DA_TRIE* da, const int* codes, int n) {
+    int firstCode = n ? codes[0] : 0;
+    int pos = greater(da->nextCheck, firstCode), used = 0, first = 1;
+    for(;; pos++) {
+        growDoubleArray(da, pos + N + 1);
+        if(da->label[pos]) {
+            used++;
+            continue;
+        }
+        if(first) {
+            first = 0;
+            used = 0;
+            da->nextCheck = pos;
+        }
+        int b = pos - firstCode, ok = !da->baseUsed[b];
+        for(int i=1; i<n && ok; i++) if(da->label[b + codes[i]]) ok = 0;
+        if(!ok) {
+            used++;
+            continue;
+        }
+        // skip over the dense front next time
+        if(used > 0 && used * 20 >= (pos - da->nextCheck) * 19) da->nextCheck = pos;
+        return b;
     }
 }
 
-void printQueue(struct LRUCache* obj){
-    printf("\nThe Cache Queue is: ");
-    struct LRUCacheQueueNode* temp=obj->head->forw;
-    while (temp!=obj->tail){
-        printf("%s ", temp->val);
-        temp=temp->forw;
+// places node and everything below it once, however many parents share it; returns its state.
+// node->count ends up as the no. of words below node, which the ranks of its parents add up.
+int placeDoubleArray(DA_TRIE* da, TRIE_NODE* node) {
+    if(node->state >= 0) return node->state;
+    int codes[N + 1], n = 0;
+    if(node->isEOW) codes[n++] = 0;
+    for(int i=0; i<26; i++) if(node->child[i]) codes[n++] = i + 1;
+    int b = findBaseDoubleArray(da, codes, n);
+    da->baseUsed[b] = 1;
+    for(int i=0; i<n; i++) da->label[b + codes[i]] = codes[i] + 1;
+    node->state = b;
+    da->nStates++;
+    // words ending here sort before their extensions, then children go in alphabetical order
+    int words = node->isEOW;
+    for(int i=0; i<n; i++) {
+        if(codes[i] == 0) continue;
+        TRIE_NODE* child = node->child[codes[i] - 1];
+        int t = placeDoubleArray(da, child);
+        da->next[b + codes[i]] = t;
+        da->rank[b + codes[i]] = words;
+        words += child->count;
     }
-    printf("\n");
+    node->count = words;
+    return b;
 }
 
-struct LRUCacheMapNode* searchCache(struct LRUCache* obj, char* string){
-    int ind=djb2(string)%(obj->maxSize);
-    struct LRUCacheMapNode* temp=obj->map[ind];
-    while (temp!=NULL && strcmp(temp->nd->val, string)!=0) temp=temp->forw;
-    return temp;
+// builds a double-array copy of a pointer trie or DAWG rooted at root
+DA_TRIE* buildDoubleArray(TRIE_NODE* root) {
+    METRIC_TIMER(start);
+    DA_TRIE* da = (DA_TRIE*)calloc(1, sizeof(DA_TRIE));
+    da->size = 1;
+    da->label = (uint8_t*)calloc(1, 1);
+    da->next = (int*)calloc(1, sizeof(int));
+    da->rank = (int*)calloc(1, sizeof(int));
+    da->baseUsed = (uint8_t*)calloc(1, 1);
+    growDoubleArray(da, 1 << 16);
+    da->root = placeDoubleArray(da, root);
+    da->nWords = root->count;
+    free(da->baseUsed);
+    da->baseUsed = NULL;
+    // trim the unused tail left by doubling
+    int last = da->size - 1;
+    while(last > 0 && !da->label[last]) last--;
+    da->size = last + 1;
+    da->label = (uint8_t*)realloc(da->label, da->size);
+    da->next = (int*)realloc(da->next, da->size * sizeof(int));
+    da->rank = (int*)realloc(da->rank, da->size * sizeof(int));
+    METRIC_ELAPSED(HIST_LOAD_DOUBLE_ARRAY, start);
+    return da;
 }
 
-void LRUCacheGet(struct LRUCache* obj, struct LRUCacheMapNode* temp){
-    temp->nd->prev->forw=temp->nd->forw;
-    temp->nd->forw->prev=temp->nd->prev;
-    insert(obj, temp->nd);
+// slot of the transition of state s on code, or -1
+int slotDoubleArray(const DA_TRIE* da, int s, int code) {
+    int t = s + code;
+    return (code >= 0 && t < da->size && da->label[t] == code + 1) ? t : -1;
 }
 
-<<<<<<< HEAD
-typedef struct suggest_thread {
-    int thread_num;
-    struct LRUCache* cache;
-    char* suggestions;
-} THREAD_INP;
+// code of a character on a double-array edge: 0 ends the word, -1 can never match
+int codeDoubleArray(char c) {
+    if(c == '\0') return 0;
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 1 : -1;
+}
 
-// Function to break a part of the file into words
-void processPart(char* part, struct LRUCache* cache, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1]) {
-    char word[MAX_LENGTH];
-    const char* delimiters = " \t\n";
-    const char* token = strtok(part, delimiters);
+// child state of s on letter c, or -1
+int childDoubleArray(const DA_TRIE* da, int s, char c) {
+    int t = slotDoubleArray(da, s, c ? codeDoubleArray(c) : -1);
+    return t < 0 ? -1 : da->next[t];
+}
+
+// true when a word ends at state s
+bool finalDoubleArray(const DA_TRIE* da, int s) {
+    return slotDoubleArray(da, s, 0) >= 0;
+}
 
-    while (token != NULL) {
-        strncpy(word, token, MAX_LENGTH);
-        store_suggestions(word, cache, suggestions);
-        token = strtok(NULL, delimiters);
+// returns the id (0 .. nWords-1) of word, or -1 when absent
+int wordIdDoubleArray(const DA_TRIE* da, const char* word) {
+    int s = da->root, id = 0;
+    for(; *word; word++) {
+        int t = slotDoubleArray(da, s, codeDoubleArray(*word));
+        if(t < 0) return -1;
+        id += da->rank[t];
+        s = da->next[t];
     }
-    // printf("**im done**");
+    return finalDoubleArray(da, s) ? id : -1;
 }
 
-void* processFile(void* thread_inp) {
-    // int thread_num = *(int*)arg;
-    THREAD_INP* input = (THREAD_INP*) thread_inp;
-    FILE* file = fopen(PARA_FILE, "r");
-    if(file == NULL) {
-        perror(COLOR_RED "Error opening paragraph file" COLOR_RESET);
-        exit(1);
+bool searchDoubleArray(const DA_TRIE* da, const char* word) {
+    int s = da->root;
+    while(*word && s >= 0) s = childDoubleArray(da, s, *word++);
+    return s >= 0 && finalDoubleArray(da, s);
+}
+
+// searchDoubleArray that also counts the slots it tested, the same steps a batched lookup lane takes
+bool walkDoubleArray(const DA_TRIE* da, const char* word, int* steps) {
+    int s = da->root;
+    for(*steps = 1; *word; word++, (*steps)++)
+        if((s = childDoubleArray(da, s, *word)) < 0) return false;
+    return finalDoubleArray(da, s);
+}
+
+// quantized log frequency of a word id, 0 for every word without a frequency table
+int frequencyDoubleArray(const DA_TRIE* da, int id) {
+    return (da->freq && id >= 0) ? da->freq[id] : 0;
+}
+
+// calls visit on every word below state in alphabetical order, prefix holds the level letters above it
+void forEachWordDoubleArray(const DA_TRIE* da, int state, char* prefix, int level, void (*visit)(const char* word, int len, void* ctx), void* ctx) {
+    if(finalDoubleArray(da, state)) {
+        prefix[level] = '\0';
+        visit(prefix, level, ctx);
+    }
+    if(level == MAX_LENGTH) return;
+    for(char c='a'; c<='z'; c++) {
+        int t = childDoubleArray(da, state, c);
+        if(t < 0) continue;
+        prefix[level] = c;
+        forEachWordDoubleArray(da, t, prefix, level+1, visit, ctx);
     }
+}
 
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+size_t completionTableSize(int n_words);
 
-    long part = file_size / N_THREADS;
-    long start = part * input->thread_num;
-    long end = input->thread_num < N_THREADS - 1 ? start + part : file_size;
+size_t sizeDoubleArray(const DA_TRIE* da) {
+    return sizeof(DA_TRIE) + (size_t)da->size * (1 + 2 * sizeof(int)) + (da->freq ? (size_t)da->nWords : 0)
+         + (da->best ? (size_t)da->nWords * sizeof(uint16_t) + completionTableSize(da->nWords) * sizeof(int) : 0);
+}
 
-    if(input->thread_num > 0) {
-        fseek(file, start, SEEK_SET);
-        while(start < end) {
-            int c = fgetc(file);
-            if(c == ' ' || c == '\t' || c == '\n') break;
-            start++;
-        }
+void freeDoubleArray(DA_TRIE* da) {
+    if(!da->mapped) {
+        free(da->label);
+        free(da->next);
+        free(da->rank);
+        free(da->freq);
+        free(da->score);
+        free(da->best);
+    }
+    else munmap(da->mapping, da->mappingSize);     // a filter mapped with it can't be used after this
+    free(da);
+}
+
+// reads "word count" lines into the quantized frequency table, counts of case variants add up
+bool loadFrequencies(DA_TRIE* da, const char* path) {
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL) return false;
+    double* counts = (double*)calloc(da->nWords, sizeof(double));
+    char* line = NULL;
+    size_t line_cap = 0;
+    char word[MAX_LENGTH + 1];
+    double count;
+    while(getline(&line, &line_cap, fp) != -1) {
+        if(sscanf(line, "%50s %lf", word, &count) != 2 || count < 0) continue;
+        for(char* c = word; *c; c++) *c = tolower((unsigned char)*c);
+        int id = wordIdDoubleArray(da, word);
+        if(id >= 0) counts[id] += count;
     }
+    free(line);
+    fclose(fp);
 
-    // Read and process the part
-    fseek(file, start, SEEK_SET);
-    char* chunk = (char*) malloc((end-start+1) * sizeof(char));
-    fread(chunk, 1, end - start, file);
-    chunk[end-start] = '\0';
-    fclose(file);
+    da->freq = (uint8_t*)malloc(da->nWords);
+    da->maxFreq = 0;
+    for(int i=0; i<da->nWords; i++) {
+        double q = round(FREQ_SCALE * log2(counts[i] + 1));
+        da->freq[i] = q > 255 ? 255 : (uint8_t)q;
+        da->maxFreq = greater(da->maxFreq, da->freq[i]);
+    }
+    free(counts);
+    return true;
+}
 
-    processPart(chunk, (struct LRUCache*) input->cache, (char*) input->suggestions);
+// Prefix completion. The words starting with a prefix are exactly the ids lo..hi-1 below its
+// state, so the best k of them come from range maximum queries over score: take the best word
+// of the range, split the range around it and repeat. States are shared between prefixes, so
+// the best descendant is kept per id block rather than per state: best[] holds the best id of
+// every COMPLETE_BLOCK ids and, p levels up, of every 2^p blocks, and a query scans at most two
+// partial blocks plus two table entries whatever the size of the range.
+typedef struct completion_scorer {
+    DA_TRIE* da;
+    int id;
+} COMPLETION_SCORER;
 
-    free(chunk);
-    return NULL;
+bool betterCompletion(const DA_TRIE* da, int a, int b) {
+    return da->score[a] > da->score[b] || (da->score[a] == da->score[b] && a < b);
 }
 
-void part_file(struct LRUCache* cache, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1]) {     // size is number of elements probably put -1 for size not known
-    pthread_t threads[N_THREADS];
-    THREAD_INP thread_inp[N_THREADS];
-    for(int i=0; i<N_THREADS; i++) {
-        thread_inp[i].thread_num = i;
-        thread_inp[i].cache = cache;
-        thread_inp[i].suggestions = suggestions;
-        pthread_create(&threads[i], NULL, processFile, &thread_inp[i]);
+void scoreCompletion(const char* word, int len, void* ctx) {
+    (void) word;
+    COMPLETION_SCORER* scorer = (COMPLETION_SCORER*)ctx;
+    scorer->da->score[scorer->id] = (frequencyDoubleArray(scorer->da, scorer->id) << 8) | (255 - len);
+    scorer->id++;
+}
+
+// entries of the block table over n_words ids
+size_t completionTableSize(int n_words) {
+    int n_blocks = (n_words + COMPLETE_BLOCK - 1) / COMPLETE_BLOCK, levels = 1;
+    while((1 << levels) <= n_blocks) levels++;
+    return (size_t)levels * n_blocks;
+}
+
+void buildCompletionTable(DA_TRIE* da) {
+    int n_blocks = (da->nWords + COMPLETE_BLOCK - 1) / COMPLETE_BLOCK, levels = 1;
+    while((1 << levels) <= n_blocks) levels++;
+    da->nBlocks = n_blocks;
+    da->best = (int*)malloc(completionTableSize(da->nWords) * sizeof(int));
+    for(int j=0; j<n_blocks; j++) {
+        int best = j * COMPLETE_BLOCK, end = smaller(best + COMPLETE_BLOCK, da->nWords);
+        for(int i=best+1; i<end; i++) if(betterCompletion(da, i, best)) best = i;
+        da->best[j] = best;
+    }
+    for(int p=1; p<levels; p++) {
+        const int* below = da->best + (size_t)(p - 1) * n_blocks;
+        for(int j=0; j + (1 << p) <= n_blocks; j++) {
+            int a = below[j], b = below[j + (1 << (p - 1))];
+            da->best[(size_t)p * n_blocks + j] = betterCompletion(da, b, a) ? b : a;
+        }
+    }
+}
+
+// scores every word, frequency first, then shorter words, then alphabetical order (the lower id),
+// and builds the table over them. Called once on a freshly built trie, after its frequencies are
+// loaded; both arrays then go into the snapshot.
+void rankCompletions(DA_TRIE* da) {
+    da->score = (uint16_t*)malloc((size_t)da->nWords * sizeof(uint16_t));
+    COMPLETION_SCORER scorer = { da, 0 };
+    char prefix[MAX_LENGTH + 1];
+    forEachWordDoubleArray(da, da->root, prefix, 0, scoreCompletion, &scorer);
+    buildCompletionTable(da);
+}
+
+// best scored id in lo..hi-1 (0 <= lo < hi <= nWords, completeDoubleArray only builds such ranges).
+// The scans go up from best, so a tie never replaces it.
+int bestCompletion(const DA_TRIE* da, int lo, int hi) {
+    int best = lo, first = lo / COMPLETE_BLOCK, last = (hi - 1) / COMPLETE_BLOCK;
+    if(first == last) {
+        for(int i=lo+1; i<hi; i++) if(da->score[i] > da->score[best]) best = i;
+        return best;
     }
-    for(int i=0; i<N_THREADS; i++) pthread_join(threads[i], NULL);
-=======
-void removeNonAlphabetical(char *word) {
-    int i, j = 0;
+    for(int i=lo+1; i<(first + 1) * COMPLETE_BLOCK; i++) if(da->score[i] > da->score[best]) best = i;
+    for(int i=last * COMPLETE_BLOCK; i<hi; i++) if(da->score[i] > da->score[best]) best = i;
+    int inner = last - first - 1;
+    if(inner > 0) {
+        // two overlapping power of two runs of blocks cover the whole blocks in between
+        int p = 31 - __builtin_clz(inner);
+        const int* level = da->best + (size_t)p * da->nBlocks;
+        int a = level[first + 1], b = level[last - (1 << p)];
+        if(betterCompletion(da, a, best)) best = a;
+        if(betterCompletion(da, b, best)) best = b;
+    }
+    return best;
+}
 
-    for (i = 0; word[i] != '\0'; i++) {
-        if (isalpha(word[i])) {
-            word[j] = tolower(word[i]);
-            j++;
+// no. of words below state s: the rank of its last edge counts every word before that edge's.
+// -1 when the walk runs past MAX_LENGTH letters or nWords words, which only a damaged trie does.
+int countDoubleArray(const DA_TRIE* da, int s) {
+    int64_t count = 0;
+    for(int level=0; level<=MAX_LENGTH && count <= da->nWords; level++) {
+        int c = N;
+        while(c > 0 && slotDoubleArray(da, s, c) < 0) c--;
+        if(c == 0) {
+            count += finalDoubleArray(da, s);
+            return count <= da->nWords ? (int)count : -1;
         }
+        count += da->rank[s + c];
+        s = da->next[s + c];
     }
-    word[j] = '\0';
->>>>>>> ed6e14fd55c1f4fa81ed99dd4889c6572653cb93
-}
\ No newline at end of file
+    return -1;
+}
+
+// writes the r-th word below state s after the level letters already in word
+void spellDoubleArray(const DA_TRIE* da, int s, int r, char* word, int level) {
+    while(level < MAX_LENGTH && !(r == 0 && finalDoubleArray(da, s))) {
+        int c = N;
+        while(c > 0 && (slotDoubleArray(da, s, c) < 0 || da->rank[s + c] > r)) c--;
+        if(c == 0) break;
+        r -= da->rank[s + c];
+        word[level++] = 'a' + c - 1;
+        s = da->next[s + c];
+    }
+    word[level] = '\0';
+}
+
+typedef struct completion_range {
+    int lo, hi;     // ids not yet returned
+    int best;
+} COMPLETION_RANGE;
+
+// up to k (at most MAX_SUGGESTIONS) words starting with prefix, best first. The prefix itself
+// counts when it is a word. Costs k range queries and k word spellings, however many words match.
+int completeDoubleArray(const DA_TRIE* da, const char* prefix, int k, char completions[MAX_SUGGESTIONS][MAX_LENGTH + 1]) {
+    METRIC_TIMER(start);
+    METRIC_ADD(METRIC_COMPLETES, 1);
+    int s = da->root, len = 0;
+    int64_t first = 0;
+    if(da->best == NULL) return 0;
+    for(; prefix[len]; len++) {
+        int t = len < MAX_LENGTH ? slotDoubleArray(da, s, codeDoubleArray(prefix[len])) : -1;
+        if(t < 0) return 0;
+        first += da->rank[t];
+        s = da->next[t];
+    }
+    // every range below lies inside lo..hi, so keeping that inside the score table keeps them all
+    int below = countDoubleArray(da, s);
+    if(below < 0 || first < 0 || first + below > da->nWords) return 0;
+    int lo = (int)first, hi = lo + below, n_ranges = 0, count = 0;
+    k = smaller(k, MAX_SUGGESTIONS);
+    // every pick replaces one range by at most two, so k picks never hold more than k + 1
+    COMPLETION_RANGE ranges[MAX_SUGGESTIONS + 1];
+    if(hi > lo) {
+        COMPLETION_RANGE all = { lo, hi, bestCompletion(da, lo, hi) };
+        ranges[n_ranges++] = all;
+    }
+    while(count < k && n_ranges > 0) {
+        int pick = 0;
+        for(int i=1; i<n_ranges; i++) if(betterCompletion(da, ranges[i].best, ranges[pick].best)) pick = i;
+        COMPLETION_RANGE range = ranges[pick];
+        ranges[pick] = ranges[--n_ranges];
+        memcpy(completions[count], prefix, len);
+        spellDoubleArray(da, s, range.best - lo, completions[count], len);
+        if(++count == k) break;
+        if(range.best > range.lo) {
+            COMPLETION_RANGE left = { range.lo, range.best, bestCompletion(da, range.lo, range.best) };
+            ranges[n_ranges++] = left;
+        }
+        if(range.best + 1 < range.hi) {
+            COMPLETION_RANGE right = { range.best + 1, range.hi, bestCompletion(da, range.best + 1, range.hi) };
+            ranges[n_ranges++] = right;
+        }
+    }
+    METRIC_ELAPSED(HIST_COMPLETE, start);
+    return count;
+}
+
+// share of random non-dictionary words the filter lets through, the trie being the ground truth
+uint64_t xorshift64(uint64_t* seed) {
+    *seed ^= *seed << 13; *seed ^= *seed >> 7; *seed ^= *seed << 17;
+    return *seed;
+}
+
+double measureFalsePositiveRate(const BLOOM_FILTER* filter, const DA_TRIE* da, int samples) {
+    char word[MAX_LENGTH + 1];
+    uint64_t seed = 88172645463325252ULL;
+    int probes = 0, positives = 0;
+    while(probes < samples) {
+        int len = 0;
+        int target = 4 + xorshift64(&seed) % 9;
+        while(len < target) word[len++] = 'a' + xorshift64(&seed) % 26;
+        word[len] = '\0';
+        if(searchDoubleArray(da, word)) continue;
+        probes++;
+        if(searchFilter(filter, word)) positives++;
+    }
+    return (double)positives / probes;
+}
+
+// a word is known when the filter does not rule it out and the trie confirms it
+bool checkWord(const BLOOM_FILTER* filter, const DA_TRIE* da, const char* word) {
+    int steps = 0;
+    bool positive = searchFilter(filter, word), known = positive && walkDoubleArray(da, word, &steps);
+    METRIC_LOOKUPS_DONE(1, 1, positive, known, steps);
+    return known;
+}
+
+// Batched lookup: identical tokens are looked up once, filter lines are prefetched for the
+// whole batch and LOOKUP_LANES trie walks advance in lock step, each prefetching the state it
+// moves to next, so their cache misses overlap instead of being paid one after another
+typedef struct lookup_lane {
+    int token;          // -1 when the lane is idle
+    const char* p;      // next character to consume
+    int state;
+    int code;           // code of *p
+    int next;           // slot p leads to, already prefetched
+} LOOKUP_LANE;
+
+void stepLane(const DA_TRIE* da, LOOKUP_LANE* lane) {
+    lane->code = codeDoubleArray(*lane->p);
+    lane->next = lane->code < 0 ? -1 : lane->state + lane->code;
+    if(lane->next >= 0 && lane->next < da->size) {
+        __builtin_prefetch(&da->label[lane->next]);
+        __builtin_prefetch(&da->next[lane->next]);
+    }
+}
+
+void checkWordsBlock(const BLOOM_FILTER* filter, const DA_TRIE* da, const char** words, int n, bool* found) {
+    METRIC_TIMER(start);
+    uint32_t h1[LOOKUP_BATCH], h2[LOOKUP_BATCH], block[LOOKUP_BATCH], step[LOOKUP_BATCH];
+    int first[LOOKUP_BATCH], unique[LOOKUP_BATCH], nUnique = 0;
+    uint64_t n_blocks = filter->nBits / 512;
+    int table[2 * LOOKUP_BATCH];
+    for(int i=0; i<2 * LOOKUP_BATCH; i++) table[i] = -1;
+
+    // dedupe on djb2, which the filter needs anyway
+    for(int i=0; i<n; i++) {
+        h1[i] = djb2(words[i]);
+        int slot = h1[i] & (2 * LOOKUP_BATCH - 1);
+        while(table[slot] >= 0 && (h1[table[slot]] != h1[i] || strcmp(words[table[slot]], words[i])))
+            slot = (slot + 1) & (2 * LOOKUP_BATCH - 1);
+        if(table[slot] >= 0) {
+            first[i] = table[slot];
+            continue;
+        }
+        table[slot] = first[i] = i;
+        h2[i] = jenkin(words[i]);
+        if(filter->blocked) {
+            // packed by unique index for the multi-key probe, the block line fetched meanwhile
+            block[nUnique] = h1[i] % n_blocks;
+            step[nUnique] = (h1[i] / n_blocks) | 1;
+            __builtin_prefetch(filter->bits + (size_t)block[nUnique] * 8);
+        }
+        unique[nUnique++] = i;
+    }
+
+    // filter stage, only its positives go on to the trie
+    int survivors[LOOKUP_BATCH], nSurvivors = 0;
+    bool positive[LOOKUP_BATCH];
+    if(filter->blocked) {
+        uint32_t unique_h2[LOOKUP_BATCH];
+        for(int u=0; u<nUnique; u++) unique_h2[u] = h2[unique[u]];
+        searchFilterLanes(filter, block, unique_h2, step, nUnique, positive);
+    }
+    else for(int u=0; u<nUnique; u++) positive[u] = searchFilterHash(filter, h1[unique[u]], h2[unique[u]]);
+    for(int u=0; u<nUnique; u++) {
+        int i = unique[u];
+        found[i] = false;
+        if(positive[u]) survivors[nSurvivors++] = i;
+    }
+
+    // trie stage
+    LOOKUP_LANE lane[LOOKUP_LANES];
+    int taken = 0, active = 0, steps = 0, confirmed = 0;
+    for(int l=0; l<LOOKUP_LANES; l++) {
+        lane[l].token = -1;
+        if(taken < nSurvivors) {
+            lane[l].token = survivors[taken++];
+            lane[l].p = words[lane[l].token];
+            lane[l].state = da->root;
+            stepLane(da, &lane[l]);
+            active++;
+        }
+    }
+    while(active > 0) {
+        for(int l=0; l<LOOKUP_LANES; l++) {
+            if(lane[l].token < 0) continue;
+            int t = lane[l].next;
+            bool valid = t >= 0 && t < da->size && da->label[t] == lane[l].code + 1;
+            steps++;
+            if(valid && *lane[l].p) {
+                lane[l].state = da->next[t];
+                lane[l].p++;
+                stepLane(da, &lane[l]);
+                continue;
+            }
+            // walk over: the end of word edge was taken, or an edge was missing
+            found[lane[l].token] = valid;
+            confirmed += valid;
+            lane[l].token = -1;
+            active--;
+            if(taken < nSurvivors) {
+                lane[l].token = survivors[taken++];
+                lane[l].p = words[lane[l].token];
+                lane[l].state = da->root;
+                stepLane(da, &lane[l]);
+                active++;
+            }
+        }
+    }
+
+    for(int i=0; i<n; i++) found[i] = found[first[i]];
+    METRIC_LOOKUPS_DONE(n, nUnique, nSurvivors, confirmed, steps);
+    METRIC_ELAPSED(HIST_LOOKUP_BATCH, start);
+}
+
+// sets bit i of known (n bits, rounded up to whole words) when words[i] is a dictionary word
+void checkWordsBatch(const BLOOM_FILTER* filter, const DA_TRIE* da, const char** words, int n, uint64_t* known) {
+    bool found[LOOKUP_BATCH];
+    memset(known, 0, ((n + 63) / 64) * sizeof(uint64_t));
+    for(int start=0; start<n; start+=LOOKUP_BATCH) {
+        int count = smaller(LOOKUP_BATCH, n - start);
+        checkWordsBlock(filter, da, words + start, count, found);
+        for(int i=0; i<count; i++) if(found[i]) known[(start + i) >> 6] |= 1ULL << ((start + i) & 63);
+    }
+}
+
+// Thread pool: workers live as long as their engine, runThreadPool hands them a batch of jobs
+// (job applied to each element of args) and returns once all of them are done
+typedef struct thread_pool {
+    pthread_t* threads;
+    int nThreads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    pthread_mutex_t submit;     // one batch at a time
+    void* (*job)(void*);
+    char* args;
+    size_t argSize;
+    int nJobs, nextJob, finished;
+    bool stop;
+} THREAD_POOL;
+
+void* poolWorker(void* arg) {
+    THREAD_POOL* pool = (THREAD_POOL*)arg;
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        while(!pool->stop && pool->nextJob >= pool->nJobs) pthread_cond_wait(&pool->wake, &pool->lock);
+        if(pool->stop) break;
+        int i = pool->nextJob++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->job(pool->args + i * pool->argSize);
+        pthread_mutex_lock(&pool->lock);
+        if(++pool->finished == pool->nJobs) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+THREAD_POOL* createThreadPool(int n_threads) {
+    THREAD_POOL* pool = (THREAD_POOL*)calloc(1, sizeof(THREAD_POOL));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    n_threads = greater(1, n_threads);
+    pool->threads = (pthread_t*)malloc(n_threads * sizeof(pthread_t));
+    for(int i=0; i<n_threads; i++) {
+        if(pthread_create(&pool->threads[pool->nThreads], NULL, poolWorker, pool)) printf(COLOR_RED "Error occured in threading\n" COLOR_RESET);
+        else pool->nThreads++;
+    }
+    return pool;
+}
+
+void runThreadPool(THREAD_POOL* pool, void* (*job)(void*), void* args, size_t argSize, int n) {
+    if(n <= 0) return;
+    pthread_mutex_lock(&pool->submit);
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->args = (char*)args;
+    pool->argSize = argSize;
+    pool->nJobs = n;
+    pool->nextJob = pool->finished = 0;
+    pthread_cond_broadcast(&pool->wake);
+    while(pool->finished < n) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit);
+}
+
+void freeThreadPool(THREAD_POOL* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i=0; i<pool->nThreads; i++) pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
+
+int levenshteinDistance(const char *s, const char *t);
+int levenshteinBounded(const char *s, const char *t, int maxDist);
+
+// BK-Tree functions (suggestion index keyed on levenshtein distance)
+typedef struct bk_node {
+    char* word;
+    int distance;           // distance to parent word
+    struct bk_node *child;  // first child
+    struct bk_node *next;   // next sibling
+} BK_NODE;
+
+BK_NODE* createBKNode(ARENA* arena, const char* word, int distance) {
+    BK_NODE* pNode = (BK_NODE*)arenaAlloc(arena, sizeof(BK_NODE));
+    pNode->word = (char*)arenaAlloc(arena, strlen(word) + 1);
+    strcpy(pNode->word, word);
+    pNode->distance = distance;
+    pNode->child = NULL;
+    pNode->next = NULL;
+    return pNode;
+}
+
+void insertBKTree(ARENA* arena, BK_NODE* root, const char* word) {
+    BK_NODE* pCrawl = root;
+    while(1) {
+        int d = levenshteinBounded(word, pCrawl->word, MAX_LENGTH);
+        if(d == 0) return;      // already present
+        BK_NODE* pChild = pCrawl->child;
+        while(pChild && pChild->distance != d) pChild = pChild->next;
+        if(!pChild) {
+            BK_NODE* pNode = createBKNode(arena, word, d);
+            pNode->next = pCrawl->child;
+            pCrawl->child = pNode;
+            return;
+        }
+        pCrawl = pChild;
+    }
+}
+
+// suggestion index used next to the trie, which part is built depends on SUGGEST_ENGINE
+typedef struct word_buckets WORD_BUCKETS;
+typedef struct suggest_index {
+    BK_NODE* bk_root;
+    WORD_BUCKETS* buckets;
+    ARENA bkArena;
+} SUGGEST_INDEX;
+
+void insertBKWord(const char* word, int len, void* index) {
+    (void) len;
+    insertBKTree(&((SUGGEST_INDEX*)index)->bkArena, ((SUGGEST_INDEX*)index)->bk_root, word);
+}
+
+// Dictionary loading: the file is mapped once and split at line breaks into one chunk per pool
+// thread. Each chunk is tokenized once into per first letter lists, then every first letter builds
+// its own minimized subtree of the DAWG (from its own arena) and adds its words to the filter, all in parallel.
+#define LOAD_SHARDS (N + 1)     // one per first letter, the last one holds words outside a..z (filter only)
+
+typedef struct word_span {
+    uint32_t offset;
+    uint32_t len;
+} WORD_SPAN;
+
+typedef struct span_list {
+    WORD_SPAN* spans;
+    int n, size;
+} SPAN_LIST;
+
+typedef struct parse_job {
+    const char* text;
+    size_t start, end;      // byte range, both ends on line breaks
+    SPAN_LIST shards[LOAD_SHARDS];
+} PARSE_JOB;
+
+typedef struct shard_job {
+    PARSE_JOB* parsed;
+    int nParsed, shard;
+    BLOOM_FILTER* filter;
+    TRIE_NODE* root;
+    ARENA* arena;
+    NODE_REGISTER* reg;     // shared by all shards, so they share suffixes too
+} SHARD_JOB;
+
+typedef struct word_ref {
+    const char* p;
+    int len;
+} WORD_REF;
+
+int compareWordRef(const void* a, const void* b) {
+    const WORD_REF* x = (const WORD_REF*)a;
+    const WORD_REF* y = (const WORD_REF*)b;
+    int c = memcmp(x->p, y->p, smaller(x->len, y->len));
+    return c ? c : x->len - y->len;
+}
+
+void appendSpan(SPAN_LIST* list, size_t offset, int len) {
+    if(list->n == list->size) {
+        list->size = greater(1024, 2 * list->size);
+        list->spans = (WORD_SPAN*)realloc(list->spans, list->size * sizeof(WORD_SPAN));
+    }
+    list->spans[list->n].offset = (uint32_t)offset;
+    list->spans[list->n++].len = (uint32_t)len;
+}
+
+// whitespace separated words, longer than MAX_LENGTH ones are cut in pieces like fscanf("%50s") did
+void* parseThread(void* job) {
+    PARSE_JOB* parse = (PARSE_JOB*)job;
+    const char* text = parse->text;
+    size_t i = parse->start;
+    while(i < parse->end) {
+        if(isspace((unsigned char)text[i])) {
+            i++;
+            continue;
+        }
+        size_t begin = i;
+        bool lower = true;
+        while(i < parse->end && i - begin < MAX_LENGTH && !isspace((unsigned char)text[i])) {
+            lower &= text[i] >= 'a' && text[i] <= 'z';
+            i++;
+        }
+        appendSpan(&parse->shards[lower ? text[begin] - 'a' : N], begin, (int)(i - begin));
+    }
+    return NULL;
+}
+
+// builds root->child[shard] as a minimized DAWG from that letter's words, sorted here since the
+// user dictionary is appended in any order, and adds them to the filter
+void* shardThread(void* job) {
+    SHARD_JOB* shard = (SHARD_JOB*)job;
+    char word[MAX_LENGTH + 1];
+    int n = 0;
+    for(int p=0; p<shard->nParsed; p++) n += shard->parsed[p].shards[shard->shard].n;
+    WORD_REF* words = (WORD_REF*)malloc((n + 1) * sizeof(WORD_REF));
+    n = 0;
+    for(int p=0; p<shard->nParsed; p++) {
+        SPAN_LIST* list = &shard->parsed[p].shards[shard->shard];
+        for(int i=0; i<list->n; i++) {
+            words[n].p = shard->parsed[p].text + list->spans[i].offset;
+            words[n].len = list->spans[i].len;
+            memcpy(word, words[n].p, words[n].len);
+            word[words[n++].len] = '\0';
+            insertFilterShared(shard->filter, word);
+        }
+    }
+    if(shard->shard < N && n > 0) {
+        qsort(words, n, sizeof(WORD_REF), compareWordRef);
+        // the first letter is the edge from the root, the subtree holds the rest of each word
+        TRIE_NODE* path[MAX_LENGTH + 1];
+        TRIE_NODE* subtree = createNode(shard->arena);
+        for(int i=0; i<n; i++) {
+            if(i > 0 && !compareWordRef(&words[i], &words[i-1])) continue;
+            const char* prev = i > 0 ? words[i-1].p + 1 : NULL;
+            insertDawg(shard->reg, shard->arena, subtree, path, prev, i > 0 ? words[i-1].len - 1 : 0, words[i].p + 1, words[i].len - 1);
+        }
+        minimizeLastChild(shard->reg, shard->arena, subtree);
+        shard->root->child[shard->shard] = registerTrieNode(shard->reg, subtree);
+    }
+    free(words);
+    return NULL;
+}
+
+// moves a split point forward to the start of the next line
+size_t lineBoundary(const char* text, size_t size, size_t pos) {
+    while(pos > 0 && pos < size && text[pos - 1] != '\n') pos++;
+    return pos;
+}
+
+// maps a word list for parsing, NULL when it is missing, empty or too big for 32 bit offsets
+const char* mapWordList(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    struct stat list_stat;
+    if(fd < 0 || fstat(fd, &list_stat) != 0 || list_stat.st_size == 0 || (uint64_t)list_stat.st_size > UINT32_MAX) {
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    *size = list_stat.st_size;
+    const char* text = (const char*)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(text == MAP_FAILED) {
+        perror(COLOR_RED "Error mapping Dictionary" COLOR_RESET);
+        return NULL;
+    }
+    madvise((void*)text, *size, MADV_SEQUENTIAL);
+    return text;
+}
+
+// populates root and a filter sized for the words of config's dictionary and user dictionary on
+// the pool's threads, trieArenas holds N arenas, the subtree of each first letter comes from its own.
+// NULL when the dictionary is missing or empty.
+BLOOM_FILTER* loadDictionary(const SPELL_CONFIG* config, THREAD_POOL* pool, TRIE_NODE* root, ARENA* trieArenas) {
+    size_t size, user_size = 0;
+    const char* text = mapWordList(config->dictPath, &size);
+    if(text == NULL) return NULL;
+    const char* user_text = mapWordList(config->userDictPath, &user_size);
+
+    // the user dictionary is small, it gets one part of its own after the dictionary's
+    int n_dict_parts = greater(1, pool->nThreads), n_parts = n_dict_parts + (user_text != NULL);
+    PARSE_JOB* parse = (PARSE_JOB*)calloc(n_parts, sizeof(PARSE_JOB));
+    for(int i=0; i<n_dict_parts; i++) {
+        parse[i].text = text;
+        parse[i].start = lineBoundary(text, size, size / n_dict_parts * i);
+        parse[i].end = i == n_dict_parts - 1 ? size : lineBoundary(text, size, size / n_dict_parts * (i + 1));
+    }
+    if(user_text) {
+        parse[n_dict_parts].text = user_text;
+        parse[n_dict_parts].end = user_size;
+    }
+    METRIC_TIMER(parse_start);
+    runThreadPool(pool, parseThread, parse, sizeof(PARSE_JOB), n_parts);
+    METRIC_ELAPSED(HIST_LOAD_PARSE, parse_start);
+
+    uint64_t n_words = 0;
+    for(int i=0; i<n_parts; i++) for(int s=0; s<LOAD_SHARDS; s++) n_words += parse[i].shards[s].n;
+    BLOOM_FILTER* filter = NULL;
+    if(n_words > 0) {
+        filter = createFilter(n_words, config->filterFpr, config->filterK, config->filterBlocked);
+        NODE_REGISTER* reg = createRegister();
+        SHARD_JOB shards[LOAD_SHARDS];
+        for(int s=0; s<LOAD_SHARDS; s++) {
+            SHARD_JOB job = { parse, n_parts, s, filter, root, s < N ? &trieArenas[s] : NULL, reg };
+            shards[s] = job;
+        }
+        METRIC_TIMER(shard_start);
+        runThreadPool(pool, shardThread, shards, sizeof(SHARD_JOB), LOAD_SHARDS);
+        METRIC_ELAPSED(HIST_LOAD_SHARDS, shard_start);
+        freeRegister(reg);
+        fprintf(stderr, COLOR_GREEN "Dictionary loaded on filter and trie successfully (%llu words, %d threads)\n" COLOR_RESET,
+                (unsigned long long)n_words, n_dict_parts);
+    }
+
+    for(int i=0; i<n_parts; i++) for(int s=0; s<LOAD_SHARDS; s++) free(parse[i].shards[s].spans);
+    free(parse);
+    munmap((void*)text, size);
+    if(user_text) munmap((void*)user_text, user_size);
+    return filter;
+}
+
+// size and mtime of the dictionary, user dictionary and frequency file, taken once before they are
+// read so a snapshot is never stamped with an edit made after its words were
+typedef struct source_files {
+    uint64_t size[3];
+    int64_t mtime[3];       // nanoseconds, 0 when the file is missing
+} SOURCE_FILES;
+
+enum { SOURCE_DICT, SOURCE_USER, SOURCE_FREQ };
+
+void statSources(const SPELL_CONFIG* config, SOURCE_FILES* sources) {
+    const char* paths[] = { config->dictPath, config->userDictPath, config->freqPath };
+    struct stat file_stat;
+    memset(sources, 0, sizeof(*sources));
+    for(int i=0; i<3; i++) if(stat(paths[i], &file_stat) == 0) {
+        sources->size[i] = file_stat.st_size;
+        sources->mtime[i] = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+    }
+}
+
+// Binary snapshot: header, double-array next, rank and label, the filter bits, the frequencies,
+// the completion scores and their block table.
+// The file is mmap'd read only, so startup does no parsing and processes share the page cache.
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nWords;
+    uint32_t daSize;
+    uint32_t filterK;
+    uint32_t filterBlocked;
+    uint32_t maxFreq;
+    uint64_t filterBits;
+    uint64_t dictSize;      // size and mtime (ns) of the dictionary it was built from
+    int64_t dictMtime;
+    uint64_t daOffset;
+    uint64_t filterOffset;
+    uint64_t freqOffset;    // 0 when built without a frequency file
+    uint64_t freqSize;      // size and mtime of that frequency file
+    int64_t freqMtime;
+    double filterFpr;
+    uint64_t userSize;      // size and mtime of the user dictionary merged in, 0 without one
+    int64_t userMtime;
+    uint32_t daRoot;
+    uint32_t daStates;
+    uint64_t scoreOffset;
+    uint64_t bestOffset;
+} SNAPSHOT_HEADER;
+
+// bytes of the double-array in a snapshot
+uint64_t snapshotArrayBytes(uint64_t size) {
+    return size * (2 * sizeof(int) + 1);
+}
+
+// bit c set when slot s + c holds code c, i.e. state s has that edge (bit 0: a word ends at s).
+// Branch free, so scanning a state costs the same however its edges fall.
+uint32_t edgeMaskDoubleArray(const uint8_t* label, uint32_t size, uint32_t s) {
+    uint32_t mask = 0;
+    if(s + N < size) for(uint32_t c=0; c<=N; c++) mask |= (uint32_t)(label[s + c] == c + 1) << c;
+    else for(uint32_t c=0; s + c < size; c++) mask |= (uint32_t)(label[s + c] == c + 1) << c;
+    return mask;
+}
+
+// checks a mapped double-array the way the walks will use it: every edge below root lands inside
+// the arrays, no path loops or runs past MAX_LENGTH letters, and every rank equals the no. of words
+// before its edge, so each id summed along a path stays below nWords. Depth first, each state once.
+bool validDoubleArray(const int* next, const int* rank, const uint8_t* label, uint32_t size, uint32_t root, uint32_t n_words) {
+    if(size > INT32_MAX || n_words > INT32_MAX || root >= size) return false;
+    int* words = (int*)malloc((size_t)size * sizeof(int));     // per state: -1 unseen, -2 on the path, else its count
+    memset(words, 0xff, (size_t)size * sizeof(int));
+    struct { uint32_t state, edges; int64_t words; } path[MAX_LENGTH + 1];     // edges not yet followed
+    int depth = 1;
+    bool valid = true;
+    uint32_t mask = edgeMaskDoubleArray(label, size, root);
+    path[0].state = root;
+    path[0].edges = mask & ~1u;
+    path[0].words = mask & 1;
+    words[root] = -2;
+    while(depth > 0 && valid) {
+        uint32_t s = path[depth - 1].state;
+        if(!path[depth - 1].edges) {
+            // all edges done, the state's words go to the edge that led here
+            words[s] = (int)path[depth - 1].words;
+            if(--depth > 0) valid = (path[depth - 1].words += words[s]) <= n_words;
+            continue;
+        }
+        int c = __builtin_ctz(path[depth - 1].edges);
+        path[depth - 1].edges &= path[depth - 1].edges - 1;
+        uint32_t t = (uint32_t)next[s + c];
+        valid = rank[s + c] == path[depth - 1].words && t < size && words[t] != -2;
+        if(!valid) break;
+        if(words[t] >= 0) valid = (path[depth - 1].words += words[t]) <= n_words;
+        else if(depth == MAX_LENGTH + 1) valid = false;
+        else {
+            mask = edgeMaskDoubleArray(label, size, t);
+            words[t] = -2;
+            path[depth].state = t;
+            path[depth].edges = mask & ~1u;
+            path[depth].words = mask & 1;
+            depth++;
+        }
+    }
+    valid = valid && (uint32_t)words[root] == n_words;
+    free(words);
+    return valid;
+}
+
+// written to config->snapshotPath, stamped with sources, the files as they were stat'ed before being read
+bool saveSnapshot(const SPELL_CONFIG* config, const SOURCE_FILES* sources, const DA_TRIE* da, const BLOOM_FILTER* filter) {
+    const char* path = config->snapshotPath;
+    SNAPSHOT_HEADER header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.magic, "SPELLDB");
+    header.version = SNAPSHOT_VERSION;
+    header.nWords = da->nWords;
+    header.daSize = da->size;
+    header.daRoot = da->root;
+    header.daStates = da->nStates;
+    header.filterK = filter->k;
+    header.filterBlocked = filter->blocked;
+    header.filterBits = filter->nBits;
+    header.filterFpr = filter->fpr;
+    header.dictSize = sources->size[SOURCE_DICT];
+    header.dictMtime = sources->mtime[SOURCE_DICT];
+    header.userSize = sources->size[SOURCE_USER];
+    header.userMtime = sources->mtime[SOURCE_USER];
+    if(da->freq) {
+        header.freqSize = sources->size[SOURCE_FREQ];
+        header.freqMtime = sources->mtime[SOURCE_FREQ];
+    }
+    header.daOffset = sizeof(header);
+    // the filter starts on a cache line so mapped blocks stay aligned
+    header.filterOffset = (header.daOffset + snapshotArrayBytes(da->size) + 63) & ~(uint64_t)63;
+    static const char padding[64];
+    size_t padBytes = header.filterOffset - header.daOffset - snapshotArrayBytes(da->size);
+    if(da->freq) {
+        header.freqOffset = header.filterOffset + filter->nBits / 8;
+        header.maxFreq = da->maxFreq;
+    }
+    uint64_t end = da->freq ? header.freqOffset + da->nWords : header.filterOffset + filter->nBits / 8;
+    header.scoreOffset = (end + 1) & ~(uint64_t)1;
+    header.bestOffset = (header.scoreOffset + da->nWords * sizeof(uint16_t) + 3) & ~(uint64_t)3;
+    size_t table_size = completionTableSize(da->nWords), table_pad = header.bestOffset - header.scoreOffset - da->nWords * sizeof(uint16_t);
+
+    // written next to the target and renamed, so readers never map a half written file
+    char tmp_path[sizeof(config->snapshotPath) + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE* fp = fopen(tmp_path, "wb");
+    if(fp == NULL) {
+        perror(COLOR_RED "Error writing snapshot" COLOR_RESET);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+           && fwrite(da->next, sizeof(int), da->size, fp) == (size_t)da->size
+           && fwrite(da->rank, sizeof(int), da->size, fp) == (size_t)da->size
+           && fwrite(da->label, 1, da->size, fp) == (size_t)da->size
+           && fwrite(padding, 1, padBytes, fp) == padBytes
+           && fwrite(filter->bits, sizeof(uint64_t), filter->nBits / 64, fp) == filter->nBits / 64
+           && (!da->freq || fwrite(da->freq, 1, da->nWords, fp) == (size_t)da->nWords)
+           && fwrite(padding, 1, header.scoreOffset - end, fp) == header.scoreOffset - end
+           && fwrite(da->score, sizeof(uint16_t), da->nWords, fp) == (size_t)da->nWords
+           && fwrite(padding, 1, table_pad, fp) == table_pad
+           && fwrite(da->best, sizeof(int), table_size, fp) == table_size;
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok || rename(tmp_path, path) != 0) {
+        perror(COLOR_RED "Error writing snapshot" COLOR_RESET);
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+// maps config's snapshot if it matches sources (the files as they are now) and config's filter settings,
+// the mapping lives until the trie is freed
+bool loadSnapshot(const SPELL_CONFIG* config, const SOURCE_FILES* sources, DA_TRIE** da, BLOOM_FILTER** filter) {
+    METRIC_TIMER(start);
+    int fd = open(config->snapshotPath, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat snap_stat;
+    if(fstat(fd, &snap_stat) != 0 || (size_t)snap_stat.st_size < sizeof(SNAPSHOT_HEADER)) {
+        close(fd);
+        return false;
+    }
+    void* map = mmap(NULL, snap_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return false;
+
+    const SNAPSHOT_HEADER* header = (const SNAPSHOT_HEADER*)map;
+    bool valid = !memcmp(header->magic, "SPELLDB", 8) && header->version == SNAPSHOT_VERSION
+              && header->daOffset == sizeof(SNAPSHOT_HEADER)
+              && header->filterK > 0 && header->filterBits > 0 && header->filterBits % 512 == 0
+              && header->filterFpr == config->filterFpr && header->filterBlocked == (uint32_t)(config->filterBlocked != 0)
+              && (config->filterK <= 0 || header->filterK == (uint32_t)config->filterK)
+              && header->filterOffset % 64 == 0
+              && header->daRoot < header->daSize
+              && header->filterOffset == ((header->daOffset + snapshotArrayBytes(header->daSize) + 63) & ~(uint64_t)63)
+              && (!header->freqOffset || header->freqOffset == header->filterOffset + header->filterBits / 8)
+              && header->scoreOffset == (((header->freqOffset ? header->freqOffset + header->nWords : header->filterOffset + header->filterBits / 8) + 1) & ~(uint64_t)1)
+              && header->bestOffset == ((header->scoreOffset + header->nWords * sizeof(uint16_t) + 3) & ~(uint64_t)3)
+              && header->bestOffset + completionTableSize(header->nWords) * sizeof(int) == (uint64_t)snap_stat.st_size;
+    // a missing dictionary or frequency file is fine, a changed or new one makes the snapshot stale
+    if(valid && sources->mtime[SOURCE_DICT])
+        valid = header->dictSize == sources->size[SOURCE_DICT] && header->dictMtime == sources->mtime[SOURCE_DICT];
+    // words dropped from the user dictionary must go too, so its removal counts as a change
+    if(valid) valid = header->userSize == sources->size[SOURCE_USER] && header->userMtime == sources->mtime[SOURCE_USER];
+    if(valid && sources->mtime[SOURCE_FREQ])
+        valid = header->freqOffset && header->freqSize == sources->size[SOURCE_FREQ] && header->freqMtime == sources->mtime[SOURCE_FREQ];
+    // a corrupt or foreign file of the right length must not send a walk outside the arrays
+    if(valid) {
+        const int* next = (const int*)((const char*)map + header->daOffset);
+        const uint8_t* label = (const uint8_t*)(next + 2 * (size_t)header->daSize);
+        valid = validDoubleArray(next, next + header->daSize, label, header->daSize, header->daRoot, header->nWords);
+        const int* best = (const int*)((const char*)map + header->bestOffset);
+        size_t table_size = completionTableSize(header->nWords);
+        for(size_t i=0; i<table_size && valid; i++) valid = (uint32_t)best[i] < header->nWords;
+    }
+    if(!valid) {
+        munmap(map, snap_stat.st_size);
+        return false;
+    }
+
+    DA_TRIE* pDict = (DA_TRIE*)malloc(sizeof(DA_TRIE));
+    pDict->next = (int*)((char*)map + header->daOffset);
+    pDict->rank = pDict->next + header->daSize;
+    pDict->label = (uint8_t*)(pDict->rank + header->daSize);
+    pDict->size = header->daSize;
+    pDict->root = header->daRoot;
+    pDict->nStates = header->daStates;
+    pDict->baseUsed = NULL;
+    pDict->nWords = header->nWords;
+    pDict->nextCheck = 0;
+    pDict->mapped = true;
+    pDict->mapping = map;
+    pDict->mappingSize = snap_stat.st_size;
+    pDict->freq = header->freqOffset ? (uint8_t*)map + header->freqOffset : NULL;
+    pDict->maxFreq = header->maxFreq;
+    pDict->score = (uint16_t*)((char*)map + header->scoreOffset);
+    pDict->best = (int*)((char*)map + header->bestOffset);
+    pDict->nBlocks = (header->nWords + COMPLETE_BLOCK - 1) / COMPLETE_BLOCK;
+    *da = pDict;
+    BLOOM_FILTER* pFilter = (BLOOM_FILTER*)malloc(sizeof(BLOOM_FILTER));
+    pFilter->bits = (uint64_t*)((char*)map + header->filterOffset);
+    pFilter->nBits = header->filterBits;
+    pFilter->k = header->filterK;
+    pFilter->fpr = header->filterFpr;
+    pFilter->blocked = header->filterBlocked;
+    pFilter->mapped = true;
+    *filter = pFilter;
+    METRIC_ELAPSED(HIST_LOAD_SNAPSHOT, start);
+    return true;
+}
+
+int levenshteinDistance(const char *s, const char *t){
+    int n = strlen(s);
+    int m = strlen(t);
+
+    if (n == 0)
+        return m;
+    if (m == 0)
+        return n;
+
+    int dp[MAX_LENGTH + 1][MAX_LENGTH + 1];
+    for (int i = 0; i <= n; i++)
+        dp[i][0] = i;
+    for (int j = 0; j <= m; j++)
+        dp[0][j] = j;
+
+    for (int i = 1; i <= n; i++)
+    {
+        for (int j = 1; j <= m; j++)
+        {
+            int cost = (s[i - 1] == t[j - 1]) ? 0 : 1;
+            dp[i][j] = smallest(dp[i - 1][j] + 1, dp[i][j - 1] + 1, dp[i - 1][j - 1] + cost);
+        }
+    }
+    return dp[n][m];
+}
+
+// Bit-parallel levenshtein (Myers/Hyyro): one 64 bit vector holds a whole DP column of s.
+// peq[c] has bit i set when s[i] == c (m = strlen(s) <= 64, m > 0), n = strlen(t).
+// Returns maxDist + 1 as soon as the distance is known to exceed maxDist.
+int myersDistance(const uint64_t* peq, int m, const char *t, int n, int maxDist){
+    uint64_t pv = ~0ULL, mv = 0, last = 1ULL << (m - 1);
+    int score = m;
+    for (int j = 0; j < n; j++)
+    {
+        uint64_t eq = peq[(unsigned char)t[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & last)
+            score++;
+        else if (mh & last)
+            score--;
+        // each remaining character of t can lower the score by at most one
+        if (score - (n - j - 1) > maxDist)
+            return maxDist + 1;
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return score > maxDist ? maxDist + 1 : score;
+}
+
+int levenshteinBounded(const char *s, const char *t, int maxDist){
+    int m = strlen(s);
+    int n = strlen(t);
+    if (m > 64) {
+        int d = levenshteinDistance(s, t);
+        return d > maxDist ? maxDist + 1 : d;
+    }
+    if (abs(m - n) > maxDist)
+        return maxDist + 1;
+    if (m == 0)
+        return n;
+
+    // kept zeroed between calls so it is never memset
+    static __thread uint64_t peq[256];
+    for (int i = 0; i < m; i++)
+        peq[(unsigned char)s[i]] |= 1ULL << i;
+    int score = myersDistance(peq, m, t, n, maxDist);
+    for (int i = 0; i < m; i++)
+        peq[(unsigned char)s[i]] = 0;
+    return score;
+}
+
+// Jaro-Winkler with the matched positions of each string kept as 64-bit masks, so a call
+// allocates nothing and is reentrant. Words longer than JW_MAX_LENGTH are scored on their prefix.
+typedef struct jaro_query {
+    const char* word;
+    int len;
+#if defined(__x86_64__) || defined(__i386__)
+    bool avx2;                       // the CPU has AVX2, chars is filled and windows are found with it
+    __m256i chars[JW_MAX_LENGTH];    // each query letter broadcast, hoisted out of scoring its candidates
+#endif
+} JARO_QUERY;
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void prepareJaroQueryAvx2(JARO_QUERY* query) {
+    for(int i=0; i<query->len; i++) query->chars[i] = _mm256_set1_epi8(query->word[i]);
+}
+
+// jaroMatchWindows comparing s2 against each query letter 64 positions at a time
+__attribute__((target("avx2")))
+void jaroMatchWindowsAvx2(const JARO_QUERY* query, const char* s2, int len2, int maxDist, uint64_t* eq) {
+    char padded[JW_MAX_LENGTH] __attribute__((aligned(32)));
+    memcpy(padded, s2, len2);
+    __m256i lo = _mm256_load_si256((const __m256i*)padded), hi = _mm256_load_si256((const __m256i*)(padded + 32));
+    uint64_t valid = len2 == 64 ? ~0ULL : (1ULL << len2) - 1;     // bytes past len2 are stale
+    for(int i=0; i<query->len; i++) {
+        uint64_t match = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, query->chars[i]))
+                       | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, query->chars[i])) << 32;
+        int start = greater(0, i - maxDist), end = smaller(len2, i + maxDist + 1);
+        uint64_t window = (end >= 64 ? ~0ULL : (1ULL << end) - 1) & ~((1ULL << start) - 1);
+        eq[i] = start < end ? match & window & valid : 0;
+    }
+}
+#endif
+
+// a query is prepared once and scores every candidate of a suggestion call
+void prepareJaroQuery(JARO_QUERY* query, const char* word) {
+    query->word = word;
+    query->len = smaller(strlen(word), JW_MAX_LENGTH);
+#if defined(__x86_64__) || defined(__i386__)
+    query->avx2 = __builtin_cpu_supports("avx2");
+    if(query->avx2) prepareJaroQueryAvx2(query);
+#endif
+}
+
+// fills eq[i] with the positions of s2 inside the match window of query letter i
+void jaroMatchWindows(const JARO_QUERY* query, const char* s2, int len2, int maxDist, uint64_t* eq) {
+#if defined(__x86_64__) || defined(__i386__)
+    if(query->avx2) {
+        jaroMatchWindowsAvx2(query, s2, len2, maxDist, eq);
+        return;
+    }
+#endif
+    for(int i=0; i<query->len; i++) {
+        eq[i] = 0;
+        for(int j=greater(0, i - maxDist); j<smaller(len2, i + maxDist + 1); j++)
+            if(query->word[i] == s2[j]) eq[i] |= 1ULL << j;
+    }
+}
+
+double jaroWinklerQuery(const JARO_QUERY* query, const char* s2) {
+    const char* s1 = query->word;
+    int len1 = query->len, len2 = smaller(strlen(s2), JW_MAX_LENGTH);
+    if(len1 == 0 || len2 == 0) return (len1 == len2) ? 1.0 : 0.0;
+    int maxDist = greater(0, greater(len1, len2) / 2 - 1);
+    uint64_t eq[JW_MAX_LENGTH];
+    jaroMatchWindows(query, s2, len2, maxDist, eq);
+
+    // each letter of s1 takes the first free equal letter of s2 in its window
+    uint64_t matched1 = 0, matched2 = 0;
+    int match = 0;
+    for(int i=0; i<len1; i++) {
+        uint64_t avail = eq[i] & ~matched2;
+        if(!avail) continue;
+        matched2 |= avail & -avail;
+        matched1 |= 1ULL << i;
+        match++;
+    }
+    if(match == 0) return 0.0;
+
+    // matched letters paired up in order, half of the mismatched pairs are transpositions
+    int t = 0;
+    for(uint64_t a = matched1, b = matched2; a; a &= a - 1, b &= b - 1)
+        t += s1[__builtin_ctzll(a)] != s2[__builtin_ctzll(b)];
+    double jaro = ((double)match / len1 + (double)match / len2 + (match - t / 2.0) / match) / 3.0;
+
+    // Winkler: boost close pairs sharing a prefix
+    if(jaro <= JW_BOOST_THRESHOLD) return jaro;
+    int prefix = 0;
+    while(prefix < smallest(len1, len2, JW_PREFIX_LENGTH) && s1[prefix] == s2[prefix]) prefix++;
+    return jaro + prefix * JW_PREFIX_SCALE * (1.0 - jaro);
+}
+
+double jaroWinklerDistance(const char* s1, const char* s2) {
+    JARO_QUERY query;
+    prepareJaroQuery(&query, s1);
+    return jaroWinklerQuery(&query, s2);
+}
+
+// Suggestion ranking, noisy channel style: log frequency of the word minus a fixed cost per edit.
+// Without a frequency table that is just levenshtein distance. Ties are broken by jaro winkler
+// similarity, then alphabetically, so every engine returns the same list whatever order it visits
+// the dictionary in.
+typedef struct suggestion {
+    char word[MAX_LENGTH + 1];
+    int distance;
+    int frequency;
+    double similarity;
+} SUGGESTION;
+
+int suggestionScore(int distance, int frequency) {
+    return frequency - CHANNEL_EDIT_COST * distance;
+}
+
+// inserts a candidate into top (kept sorted, at most k entries), returns the new count
+int rankSuggestion(SUGGESTION* top, int count, int k, const char* word, int distance, int frequency, double similarity) {
+    METRIC_ADD(METRIC_RANKED, 1);
+    int score = suggestionScore(distance, frequency), pos = count;
+    while(pos > 0) {
+        int last = suggestionScore(top[pos-1].distance, top[pos-1].frequency);
+        if(last > score || (last == score && (top[pos-1].similarity > similarity ||
+           (top[pos-1].similarity == similarity && strcmp(top[pos-1].word, word) <= 0)))) break;
+        pos--;
+    }
+    if(pos >= k) return count;
+    if(count < k) count++;
+    for(int i=count-1; i>pos; i--) top[i] = top[i-1];
+    strcpy(top[pos].word, word);
+    top[pos].distance = distance;
+    top[pos].frequency = frequency;
+    top[pos].similarity = similarity;
+    return count;
+}
+
+// farthest a candidate no more frequent than maxFreq can be and still enter top, -1 if none can.
+// Once top is full the search stops at this distance.
+int rankBound(const SUGGESTION* top, int count, int k, int maxDist, int maxFreq) {
+    if(count < k) return maxDist;
+    int slack = maxFreq - suggestionScore(top[k-1].distance, top[k-1].frequency);
+    return slack < 0 ? -1 : smaller(maxDist, slack / CHANNEL_EDIT_COST);
+}
+
+// root holds the empty word, so its children are keyed on word length
+void searchBKTree(BK_NODE* root, const DA_TRIE* da, char* word, const JARO_QUERY* query, int tolerance, SUGGESTION* top, int* count, int k) {
+    int d = levenshteinBounded(word, root->word, MAX_LENGTH);
+    METRIC_ADD(METRIC_CANDIDATES, 1);
+    if(d <= tolerance && root->word[0])
+        *count = rankSuggestion(top, *count, k, root->word, d, frequencyDoubleArray(da, wordIdDoubleArray(da, root->word)), jaroWinklerQuery(query, root->word));
+    for(BK_NODE* pChild = root->child; pChild; pChild = pChild->next)
+        if(pChild->distance >= d - tolerance && pChild->distance <= d + tolerance) searchBKTree(pChild, da, word, query, tolerance, top, count, k);
+}
+
+// Fuzzy trie search over the double-array DAWG: carries one levenshtein DP row per level, so
+// shared prefixes are scored once.
+// id is the sum of ranks on the way to state, words ending below it add their own on top.
+// Returns the number of DP rows computed.
+int fuzzySearchDoubleArrayState(const DA_TRIE* da, int state, int id, char* prefix, int level, const char* word, const JARO_QUERY* query, int len, const int* prevRow, int maxDist, SUGGESTION* top, int* count, int k) {
+    int row[MAX_LENGTH + 1], rows = 0;
+    for(char c='a'; c<='z'; c++) {
+        int slot = slotDoubleArray(da, state, c - 'a' + 1);
+        if(slot < 0) continue;
+        rows++;
+        int t = da->next[slot];
+        int rowMin = row[0] = prevRow[0] + 1;
+        for(int j=1; j<=len; j++) {
+            row[j] = smallest(prevRow[j] + 1, row[j-1] + 1, prevRow[j-1] + (word[j-1] != c));
+            if(row[j] < rowMin) rowMin = row[j];
+        }
+        int bound = rankBound(top, *count, k, maxDist, da->maxFreq);
+        if(rowMin > bound) continue;
+        prefix[level] = c;
+        if(row[len] <= bound && finalDoubleArray(da, t)) {
+            prefix[level+1] = '\0';
+            *count = rankSuggestion(top, *count, k, prefix, row[len], frequencyDoubleArray(da, id + da->rank[slot]), jaroWinklerQuery(query, prefix));
+        }
+        if(level + 1 < MAX_LENGTH) rows += fuzzySearchDoubleArrayState(da, t, id + da->rank[slot], prefix, level+1, word, query, len, row, maxDist, top, count, k);
+    }
+    return rows;
+}
+
+int fuzzySearchDoubleArray(const DA_TRIE* da, const char* word, int maxDist, SUGGESTION* top, int k) {
+    int len = strlen(word), count = 0;
+    if(len > MAX_LENGTH) return 0;
+    int row[MAX_LENGTH + 1];
+    char prefix[MAX_LENGTH + 1];
+    JARO_QUERY query;
+    prepareJaroQuery(&query, word);
+    for(int j=0; j<=len; j++) row[j] = j;
+    int rows = fuzzySearchDoubleArrayState(da, da->root, 0, prefix, 0, word, &query, len, row, maxDist, top, &count, k);
+    METRIC_ADD(METRIC_CANDIDATES, rows);
+    return count;
+}
+
+// Length buckets: the dictionary as one string pool split by (length, first letter), each
+// bucket a run of fixed stride words, so only lengths within the edit bound are scanned and
+// the distance kernel streams through memory in order.
+// A parallel array holds each word's set of letters, a lower bound that skips most kernels.
+struct word_buckets {
+    char* pool;
+    uint32_t* letters;
+    long offset[MAX_LENGTH + 1][N];    // byte offset of a bucket in pool, words take length + 1 bytes
+    uint8_t* freq;                     // quantized frequency of each word, parallel to letters
+    int first[MAX_LENGTH + 1][N];      // index of a bucket's first word in letters
+    int count[MAX_LENGTH + 1][N];
+    int nWords;
+    int maxFreq;
+};
+
+uint32_t letterMask(const char* word, int len) {
+    uint32_t mask = 0;
+    for(int i=0; i<len; i++) mask |= 1u << (word[i] - 'a');
+    return mask;
+}
+
+// every edit adds at most one letter the word lacks and drops at most one it has
+int letterBound(uint32_t a, uint32_t b) {
+    return greater(__builtin_popcount(a & ~b), __builtin_popcount(b & ~a));
+}
+
+void countBucketWord(const char* word, int len, void* ctx) {
+    ((WORD_BUCKETS*)ctx)->count[len][word[0] - 'a']++;
+}
+
+typedef struct bucket_fill {
+    WORD_BUCKETS* buckets;
+    const DA_TRIE* da;
+} BUCKET_FILL;
+
+void fillBucketWord(const char* word, int len, void* ctx) {
+    WORD_BUCKETS* buckets = ((BUCKET_FILL*)ctx)->buckets;
+    int c = word[0] - 'a', slot = buckets->first[len][c] + buckets->count[len][c];
+    buckets->letters[slot] = letterMask(word, len);
+    buckets->freq[slot] = frequencyDoubleArray(((BUCKET_FILL*)ctx)->da, wordIdDoubleArray(((BUCKET_FILL*)ctx)->da, word));
+    memcpy(buckets->pool + buckets->offset[len][c] + (long)buckets->count[len][c]++ * (len + 1), word, len + 1);
+}
+
+WORD_BUCKETS* buildBuckets(const DA_TRIE* da) {
+    WORD_BUCKETS* buckets = (WORD_BUCKETS*)calloc(1, sizeof(WORD_BUCKETS));
+    char prefix[MAX_LENGTH + 1];
+    forEachWordDoubleArray(da, da->root, prefix, 0, countBucketWord, buckets);
+    long size = 0;
+    for(int len=1; len<=MAX_LENGTH; len++) {
+        for(int c=0; c<N; c++) {
+            buckets->offset[len][c] = size;
+            buckets->first[len][c] = buckets->nWords;
+            size += (long)buckets->count[len][c] * (len + 1);
+            buckets->nWords += buckets->count[len][c];
+            buckets->count[len][c] = 0;     // refilled as the words are copied in
+        }
+    }
+    buckets->pool = (char*)malloc(size + 1);
+    buckets->letters = (uint32_t*)malloc(((size_t)buckets->nWords + 1) * sizeof(uint32_t));
+    buckets->freq = (uint8_t*)malloc((size_t)buckets->nWords + 1);
+    buckets->maxFreq = da->maxFreq;
+    BUCKET_FILL fill = { buckets, da };
+    forEachWordDoubleArray(da, da->root, prefix, 0, fillBucketWord, &fill);
+    return buckets;
+}
+
+size_t sizeBuckets(const WORD_BUCKETS* buckets) {
+    size_t size = sizeof(WORD_BUCKETS) + (size_t)buckets->nWords * (sizeof(uint32_t) + 1);
+    for(int len=1; len<=MAX_LENGTH; len++)
+        for(int c=0; c<N; c++) size += (size_t)buckets->count[len][c] * (len + 1);
+    return size;
+}
+
+void freeBuckets(WORD_BUCKETS* buckets) {
+    free(buckets->pool);
+    free(buckets->letters);
+    free(buckets->freq);
+    free(buckets);
+}
+
+// scans lengths nearest to the word's first, so the top-k fills early and the bound tightens
+int searchBuckets(const WORD_BUCKETS* buckets, const char* word, int maxDist, SUGGESTION* top, int k) {
+    int m = strlen(word), count = 0;
+    if(m == 0 || m > MAX_LENGTH) return 0;
+    uint64_t peq[256];
+    memset(peq, 0, sizeof(peq));
+    for(int i=0; i<m; i++) peq[(unsigned char)word[i]] |= 1ULL << i;
+    uint32_t mask = letterMask(word, m);
+    JARO_QUERY query;
+    prepareJaroQuery(&query, word);
+
+    for(int delta=0; delta<=maxDist; delta++) {
+        for(int side=0; side<(delta ? 2 : 1); side++) {
+            int len = side ? m + delta : m - delta;
+            int bound = rankBound(top, count, k, maxDist, buckets->maxFreq);
+            if(delta > bound) return count;     // top is settled, every word left is at least delta edits away
+            if(len < 1 || len > MAX_LENGTH) continue;
+            for(int c=0; c<N; c++) {
+                if(BUCKET_SAME_FIRST_LETTER && c != word[0] - 'a') continue;
+                const char* candidate = buckets->pool + buckets->offset[len][c];
+                const uint32_t* letters = buckets->letters + buckets->first[len][c];
+                const uint8_t* freq = buckets->freq + buckets->first[len][c];
+                for(int i=0; i<buckets->count[len][c]; i++, candidate += len + 1) {
+                    // a rare word has to be closer than the bound to outscore the top
+                    int wordBound = freq[i] < buckets->maxFreq ? rankBound(top, count, k, bound, freq[i]) : bound;
+                    if(letterBound(mask, letters[i]) > wordBound) continue;
+                    int d = myersDistance(peq, m, candidate, len, wordBound);
+                    METRIC_ADD(METRIC_CANDIDATES, 1);
+                    if(d > wordBound) continue;
+                    count = rankSuggestion(top, count, k, candidate, d, freq[i], jaroWinklerQuery(&query, candidate));
+                    bound = rankBound(top, count, k, maxDist, buckets->maxFreq);
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// LRU cache from a misspelled word to its ranked suggestions
+struct LRUCacheQueueNode{
+    char val[MAX_LENGTH + 1];
+    char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+    int count;
+    struct LRUCacheQueueNode* prev;
+    struct LRUCacheQueueNode* forw;
+};
+
+struct LRUCacheMapNode{
+    struct LRUCacheQueueNode* nd;
+    struct LRUCacheMapNode* prev;
+    struct LRUCacheMapNode* forw;
+};
+
+struct LRUCacheQueueNode* createQueueNode(ARENA* arena, char* string) {
+    struct LRUCacheQueueNode* ans = (struct LRUCacheQueueNode*)arenaAlloc(arena, sizeof(struct LRUCacheQueueNode));
+    strcpy(ans->val, string);
+    ans->count = 0;
+    ans->forw = NULL;
+    ans->prev = NULL;
+    return ans;
+}
+
+struct LRUCacheMap{
+    struct LRUCacheMapNode** arr;
+};
+
+struct LRUCache{
+    struct LRUCacheQueueNode *head, *tail;
+    struct LRUCacheMapNode** map;
+    int size;
+    int maxSize;
+    ARENA queueArena, mapArena;     // per cache, so caches on different threads never share an arena
+};
+
+struct LRUCacheMapNode* createHashNode(struct LRUCache* obj, char* string){
+    struct LRUCacheMapNode* ans=(struct LRUCacheMapNode*)arenaAlloc(&obj->mapArena, sizeof(struct LRUCacheMapNode));
+    ans->nd=createQueueNode(&obj->queueArena, string);
+    ans->prev=NULL;
+    ans->forw=NULL;
+    return ans;
+}
+
+struct LRUCache* createLRUCache(int sz){
+    struct LRUCache* res=(struct LRUCache*)calloc(1, sizeof(struct LRUCache));
+    res->map=(struct LRUCacheMapNode**)malloc(sizeof(struct LRUCacheMapNode*)*sz);
+    for (int i=0; i<sz; i++) res->map[i]=NULL;
+    res->size=0;
+    res->maxSize=sz;
+    res->head=createQueueNode(&res->queueArena, "");
+    res->tail=createQueueNode(&res->queueArena, "");
+    res->head->forw=res->tail;
+    res->tail->prev=res->head;
+    return res;
+};
+
+void freeLRUCache(struct LRUCache* obj){
+    arenaFree(&obj->queueArena);
+    arenaFree(&obj->mapArena);
+    free(obj->map);
+    free(obj);
+}
+
+void insert(struct LRUCache* obj, struct LRUCacheQueueNode* nd){
+    nd->prev = obj->head;
+    nd->forw = obj->head->forw;
+    obj->head->forw->prev = nd;
+    obj->head->forw = nd;
+}
+
+struct LRUCacheQueueNode* deleteQueue(struct LRUCache* obj){
+    struct LRUCacheQueueNode* previousNode = obj->tail->prev;
+    previousNode->prev->forw = obj->tail;
+    obj->tail->prev = previousNode->prev;
+    return previousNode;
+}
+
+void deleteHsh(struct LRUCache* obj, struct LRUCacheQueueNode* QNode){
+    int ind=djb2(QNode->val)%(obj->maxSize);
+    struct LRUCacheMapNode* temp=obj->map[ind];
+    while (temp->nd!=QNode) temp=temp->forw;
+    if (obj->map[ind]==temp){
+        obj->map[ind]=temp->forw;
+        if (temp->forw!=NULL) temp->forw->prev=NULL;
+    }
+    else{
+        temp->prev->forw=temp->forw;
+        if (temp->forw!=NULL) temp->forw->prev=temp->prev;
+    }
+    arenaRecycle(&obj->mapArena, temp);
+}
+
+void printQueue(struct LRUCache* obj){
+    printf("\nThe Cache Queue is: ");
+    struct LRUCacheQueueNode* temp=obj->head->forw;
+    while (temp!=obj->tail){
+        printf("%s ", temp->val);
+        temp=temp->forw;
+    }
+    printf("\n");
+}
+
+struct LRUCacheMapNode* searchCache(struct LRUCache* obj, char* string){
+    int ind=djb2(string)%(obj->maxSize);
+    struct LRUCacheMapNode* temp=obj->map[ind];
+    while (temp!=NULL && strcmp(temp->nd->val, string)!=0) temp=temp->forw;
+    return temp;
+}
+
+void LRUCacheGet(struct LRUCache* obj, struct LRUCacheMapNode* temp){
+    temp->nd->prev->forw=temp->nd->forw;
+    temp->nd->forw->prev=temp->nd->prev;
+    insert(obj, temp->nd);
+}
+
+// stores the suggestions of string, returns true when the least recently used entry was evicted for it
+bool lRUCachePut(struct LRUCache* obj, char* string, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1], int count) {
+    struct LRUCacheMapNode* found=searchCache(obj, string);
+    if (found!=NULL){
+        // a refresh (two workers missed the same word) takes no new entry
+        LRUCacheGet(obj, found);
+        for (int i=0; i<count; i++) strcpy(found->nd->suggestions[i], suggestions[i]);
+        found->nd->count=count;
+        return false;
+    }
+    int ind=djb2(string)%(obj->maxSize);
+    found=createHashNode(obj, string);
+    found->forw=obj->map[ind];
+    if (obj->map[ind]!=NULL) obj->map[ind]->prev=found;
+    obj->map[ind]=found;
+    insert(obj, found->nd);
+    for (int i=0; i<count; i++) strcpy(found->nd->suggestions[i], suggestions[i]);
+    found->nd->count=count;
+
+    if (obj->size<obj->maxSize){
+        obj->size++;
+        return false;
+    }
+    struct LRUCacheQueueNode* QNode=deleteQueue(obj);
+    deleteHsh(obj, QNode);
+    arenaRecycle(&obj->queueArena, QNode);
+    return true;
+}
+
+// Sharded suggestion cache: each shard is an LRUCache behind its own lock, picked by a second
+// hash of the word, so worker threads only contend when they hit the same shard
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    struct LRUCache* lru;
+} __attribute__((aligned(64))) CACHE_SHARD;
+
+typedef struct suggestion_cache {
+    CACHE_SHARD shard[CACHE_SHARDS];
+    CACHE_COUNTS counts;                // updated atomically
+} SUGGESTION_CACHE;
+
+SUGGESTION_CACHE* createSuggestionCache(int capacity) {
+    SUGGESTION_CACHE* cache = (SUGGESTION_CACHE*)aligned_alloc(64, sizeof(SUGGESTION_CACHE));
+    for(int i=0; i<CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shard[i].lock, NULL);
+        cache->shard[i].lru = createLRUCache(greater(1, capacity / CACHE_SHARDS));
+    }
+    cache->counts.hits = cache->counts.misses = cache->counts.evictions = 0;
+    return cache;
+}
+
+void freeSuggestionCache(SUGGESTION_CACHE* cache) {
+    for(int i=0; i<CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&cache->shard[i].lock);
+        freeLRUCache(cache->shard[i].lru);
+    }
+    free(cache);
+}
+
+// cache key: the word lower cased with non letters dropped, false when it does not fit
+bool normalizeCacheKey(const char* word, char key[MAX_LENGTH + 1]) {
+    int len = 0;
+    for(; *word; word++) {
+        if(!isalpha((unsigned char)*word)) continue;
+        if(len == MAX_LENGTH) return false;
+        key[len++] = tolower((unsigned char)*word);
+    }
+    key[len] = '\0';
+    return true;
+}
+
+// copies the cached suggestions of word, returns their count or -1 on a miss
+int searchSuggestionCache(SUGGESTION_CACHE* cache, const char* word, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1]) {
+    char key[MAX_LENGTH + 1];
+    if(!normalizeCacheKey(word, key)) return -1;
+    CACHE_SHARD* shard = &cache->shard[jenkin(key) % CACHE_SHARDS];
+    int count = -1;
+    pthread_mutex_lock(&shard->lock);
+    struct LRUCacheMapNode* found = searchCache(shard->lru, key);
+    if(found) {
+        LRUCacheGet(shard->lru, found);
+        count = found->nd->count;
+        for(int i=0; i<count; i++) strcpy(suggestions[i], found->nd->suggestions[i]);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_fetch_add(count < 0 ? &cache->counts.misses : &cache->counts.hits, 1, __ATOMIC_RELAXED);
+    return count;
+}
+
+void putSuggestionCache(SUGGESTION_CACHE* cache, const char* word, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1], int count) {
+    char key[MAX_LENGTH + 1];
+    if(!normalizeCacheKey(word, key)) return;
+    CACHE_SHARD* shard = &cache->shard[jenkin(key) % CACHE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    bool evicted = lRUCachePut(shard->lru, key, suggestions, count);
+    pthread_mutex_unlock(&shard->lock);
+    if(evicted) __atomic_fetch_add(&cache->counts.evictions, 1, __ATOMIC_RELAXED);
+}
+
+// a copy of the counters, threads keep counting meanwhile
+CACHE_COUNTS cacheCounts(SUGGESTION_CACHE* cache) {
+    CACHE_COUNTS counts;
+    counts.hits = __atomic_load_n(&cache->counts.hits, __ATOMIC_RELAXED);
+    counts.misses = __atomic_load_n(&cache->counts.misses, __ATOMIC_RELAXED);
+    counts.evictions = __atomic_load_n(&cache->counts.evictions, __ATOMIC_RELAXED);
+    return counts;
+}
+
+void printCacheStats(FILE* out, SUGGESTION_CACHE* cache) {
+    CACHE_COUNTS counts = cacheCounts(cache);
+    fprintf(out, COLOR_CYAN "Suggestion cache: %ld hits, %ld misses (%.1f percent hit rate), %ld evictions\n" COLOR_RESET,
+            counts.hits, counts.misses, counts.hits + counts.misses ? counts.hits * 100.0 / (counts.hits + counts.misses) : 0.0, counts.evictions);
+}
+
+// builds the part of the suggestion index SUGGEST_ENGINE searches, the trie walk needs none
+void buildSuggestIndex(SUGGEST_INDEX* index, const DA_TRIE* da) {
+    memset(index, 0, sizeof(SUGGEST_INDEX));
+#if SUGGEST_ENGINE == ENGINE_BK_TREE
+    char prefix[MAX_LENGTH + 1];
+    index->bk_root = createBKNode(&index->bkArena, "", 0);
+    forEachWordDoubleArray(da, da->root, prefix, 0, insertBKWord, index);
+#elif SUGGEST_ENGINE == ENGINE_BUCKETS
+    index->buckets = buildBuckets(da);
+#else
+    (void) da;
+#endif
+}
+
+// bytes held by whichever part of the index was built
+size_t sizeSuggestIndex(SUGGEST_INDEX* index) {
+    return arenaSize(&index->bkArena) + (index->buckets ? sizeBuckets(index->buckets) : 0);
+}
+
+void freeSuggestIndex(SUGGEST_INDEX* index) {
+    arenaFree(&index->bkArena);
+    if(index->buckets) freeBuckets(index->buckets);
+    index->bk_root = NULL;
+    index->buckets = NULL;
+}
+
+int suggest(DA_TRIE* dict, SUGGEST_INDEX* index, char *word, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1]){
+    METRIC_TIMER(start);
+    SUGGESTION top[MAX_SUGGESTIONS];
+    int num_suggestions = 0;
+
+#if SUGGEST_ENGINE == ENGINE_BK_TREE
+    JARO_QUERY query;
+    prepareJaroQuery(&query, word);
+    // widen the search only when closer candidates are not found
+    for (int tolerance = 1; tolerance <= MAX_EDIT_DISTANCE && num_suggestions == 0; tolerance++)
+        searchBKTree(index->bk_root, dict, word, &query, tolerance, top, &num_suggestions, MAX_SUGGESTIONS);
+#elif SUGGEST_ENGINE == ENGINE_BUCKETS
+    (void) dict;
+    num_suggestions = searchBuckets(index->buckets, word, MAX_EDIT_DISTANCE, top, MAX_SUGGESTIONS);
+#else
+    (void) index;
+    num_suggestions = fuzzySearchDoubleArray(dict, word, MAX_EDIT_DISTANCE, top, MAX_SUGGESTIONS);
+#endif
+
+    for (int i = 0; i < num_suggestions; i++) strcpy(suggestions[i], top[i].word);
+    METRIC_ADD(METRIC_SUGGESTS, 1);
+    METRIC_ELAPSED(HIST_SUGGEST, start);
+    return num_suggestions;
+}
+
+// suggest() behind the cache, safe to call from any thread
+int suggestCached(DA_TRIE* dict, SUGGEST_INDEX* index, SUGGESTION_CACHE* cache, char *word, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1]){
+    int num_suggestions = searchSuggestionCache(cache, word, suggestions);
+    if (num_suggestions >= 0) return num_suggestions;
+    num_suggestions = suggest(dict, index, word, suggestions);
+    putSuggestionCache(cache, word, suggestions, num_suggestions);
+    return num_suggestions;
+}
+
+// Batch file checking: the file is checked in rounds of one CHECK_CHUNK range per thread, every
+// thread writes its report into its own buffer and after each round the buffers are printed in
+// file order, so the report streams out and memory stays bounded whatever the file size
+typedef struct suggest_thread {
+    const char* text;       // whole file, shared read only
+    long start, end;        // byte range, both ends on word boundaries
+    DA_TRIE* dict;
+    BLOOM_FILTER* filter;
+    SUGGEST_INDEX* index;
+    SUGGESTION_CACHE* cache;
+    char* output;           // report lines for this range
+    size_t outputLen, outputCap;
+    long nWords, nMisspelled;
+} THREAD_INP;
+
+void appendOutput(THREAD_INP* input, const char* string, size_t len) {
+    if(input->outputLen + len + 1 > input->outputCap) {
+        input->outputCap = greater(1 << 16, 2 * (input->outputLen + len + 1));
+        input->output = (char*)realloc(input->output, input->outputCap);
+    }
+    memcpy(input->output + input->outputLen, string, len);
+    input->outputLen += len;
+    input->output[input->outputLen] = '\0';
+}
+
+#define REPORT_LINE_SIZE (32 + (MAX_SUGGESTIONS + 1) * (MAX_LENGTH + 1))
+
+// formats one misspelled word as "offset<TAB>word<TAB>suggestion,suggestion,...\n", offset in bytes
+int formatMisspelling(char* line, long offset, const char* word, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1], int num_suggestions) {
+    int len = sprintf(line, "%ld\t%s\t", offset, word);
+    for(int i=0; i<num_suggestions; i++) len += sprintf(line + len, i ? ",%s" : "%s", suggestions[i]);
+    line[len++] = '\n';
+    line[len] = '\0';
+    return len;
+}
+
+void reportMisspelling(THREAD_INP* input, long offset, char* word) {
+    char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+    char line[REPORT_LINE_SIZE];
+    int num_suggestions = suggestCached(input->dict, input->index, input->cache, word, suggestions);
+    appendOutput(input, line, formatMisspelling(line, offset, word, suggestions, num_suggestions));
+}
+
+// looks up the collected words of a range together and reports the unknown ones in order
+void flushPart(THREAD_INP* input, char words[LOOKUP_BATCH][MAX_LENGTH + 1], const long* offsets, int n) {
+    const char* ptrs[LOOKUP_BATCH];
+    uint64_t known[LOOKUP_BATCH / 64];
+    for(int i=0; i<n; i++) ptrs[i] = words[i];
+    checkWordsBatch(input->filter, input->dict, ptrs, n, known);
+    for(int i=0; i<n; i++) {
+        if(known[i >> 6] >> (i & 63) & 1) continue;
+        input->nMisspelled++;
+        reportMisspelling(input, offsets[i], words[i]);
+    }
+}
+
+// Function to break a part of the file into words
+void processPart(THREAD_INP* input) {
+    char words[LOOKUP_BATCH][MAX_LENGTH + 1];
+    long offsets[LOOKUP_BATCH];
+    int n = 0;
+    long i = input->start;
+    while(i < input->end) {
+        if(!isalpha((unsigned char)input->text[i])) {
+            i++;
+            continue;
+        }
+        long begin = i;
+        int len = 0;
+        char* word = words[n];
+        while(i < input->end && isalpha((unsigned char)input->text[i])) {
+            if(len < MAX_LENGTH) word[len] = tolower((unsigned char)input->text[i]);
+            len++;
+            i++;
+        }
+        if(len > MAX_LENGTH) continue;      // too long to be a word, not worth suggesting for
+        word[len] = '\0';
+        offsets[n++] = begin;
+        input->nWords++;
+        if(n == LOOKUP_BATCH) {
+            flushPart(input, words, offsets, n);
+            n = 0;
+        }
+    }
+    flushPart(input, words, offsets, n);
+}
+
+void* processFile(void* thread_inp) {
+    processPart((THREAD_INP*) thread_inp);
+    return NULL;
+}
+
+// moves a split point forward until it no longer cuts a word in two
+long wordBoundary(const char* text, long size, long pos) {
+    while(pos > 0 && pos < size && isalpha((unsigned char)text[pos - 1]) && isalpha((unsigned char)text[pos])) pos++;
+    return pos;
+}
+
+// spell checks a whole file on n_threads threads, writes the report to out, returns no. of misspelled words or -1
+// one part per pool thread in each round
+long part_file(const char* path, THREAD_POOL* pool, DA_TRIE* dict, BLOOM_FILTER* filter, SUGGEST_INDEX* index, SUGGESTION_CACHE* cache, FILE* out, long* n_words) {
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if(fd < 0 || fstat(fd, &file_stat) != 0) {
+        perror(COLOR_RED "Error opening paragraph file" COLOR_RESET);
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    long size = file_stat.st_size;
+    const char* text = "";
+    if(size > 0) {
+        text = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(text == MAP_FAILED) {
+            perror(COLOR_RED "Error mapping paragraph file" COLOR_RESET);
+            close(fd);
+            return -1;
+        }
+        madvise((void*)text, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    int n_threads = greater(1, pool->nThreads);
+    long page = sysconf(_SC_PAGESIZE);
+    THREAD_INP* thread_inp = (THREAD_INP*)calloc(n_threads, sizeof(THREAD_INP));
+    for(int i=0; i<n_threads; i++) {
+        thread_inp[i].text = text;
+        thread_inp[i].dict = dict;
+        thread_inp[i].filter = filter;
+        thread_inp[i].index = index;
+        thread_inp[i].cache = cache;
+    }
+    for(long round_start = 0; round_start < size; ) {
+        long round_end = wordBoundary(text, size, size - round_start > (long)n_threads * CHECK_CHUNK ? round_start + (long)n_threads * CHECK_CHUNK : size);
+        for(int i=0; i<n_threads; i++) {
+            thread_inp[i].start = i == 0 ? round_start : thread_inp[i - 1].end;
+            long split = round_start + (long)CHECK_CHUNK * (i + 1);
+            thread_inp[i].end = i == n_threads - 1 || split >= round_end ? round_end : wordBoundary(text, size, split);
+        }
+        runThreadPool(pool, processFile, thread_inp, sizeof(THREAD_INP), n_threads);
+        for(int i=0; i<n_threads; i++) {
+            if(thread_inp[i].outputLen) fwrite(thread_inp[i].output, 1, thread_inp[i].outputLen, out);
+            thread_inp[i].outputLen = 0;
+        }
+        fflush(out);
+        // the checked pages are not read again
+        if(round_end / page > round_start / page) madvise((void*)(text + round_start / page * page), (round_end / page - round_start / page) * page, MADV_DONTNEED);
+        round_start = round_end;
+    }
+
+    long misspelled = 0;
+    *n_words = 0;
+    for(int i=0; i<n_threads; i++) {
+        free(thread_inp[i].output);
+        misspelled += thread_inp[i].nMisspelled;
+        *n_words += thread_inp[i].nWords;
+    }
+    if(size > 0) munmap((void*)text, size);
+    free(thread_inp);
+    return misspelled;
+}
+
+// Spell engine: a dictionary with its filter, suggestion index and cache, plus worker threads, all
+// sized from a config. Engines share no state, so a process can load several and query them at once.
+// The dictionary is rebuilt in the background when its files change and published with one atomic
+// pointer swap. Readers never wait: they register in a reader slot under the current epoch parity,
+// and the old dictionary is freed only once every reader that could have seen it has left.
+typedef struct spell_dictionary {
+    DA_TRIE* dict;
+    BLOOM_FILTER* filter;
+    SUGGEST_INDEX index;
+    SUGGESTION_CACHE* cache;    // per dictionary, suggestions change with the word list
+    int64_t stamp;              // sourceStamp of the files it was built from
+} SPELL_DICTIONARY;
+
+typedef struct reader_slot {
+    long count[2];      // readers inside, by the epoch parity they entered under
+    char pad[64 - 2 * sizeof(long)];
+} READER_SLOT;
+
+typedef struct spell_engine {
+    READER_SLOT readers[READER_SLOTS];      // first, so the slots start on a cache line
+    SPELL_CONFIG config;
+    SPELL_DICTIONARY* current;      // swapped by reloadEngine
+    int epoch;
+    pthread_mutex_t reload;         // one rebuild at a time
+    THREAD_POOL* pool;
+    pthread_t watcher;              // polls the files every reloadInterval seconds
+    pthread_mutex_t watchLock;
+    pthread_cond_t watchStop;
+    bool watching, stopping;
+} SPELL_ENGINE;
+
+int next_reader_slot = 0;
+__thread int reader_slot = -1;      // the calling thread's slot, the same in every engine
+
+// enters a read side section and returns the current dictionary, it stays valid until
+// leaveEngine(engine, ticket) however many reloads publish in between
+SPELL_DICTIONARY* enterEngine(SPELL_ENGINE* engine, int* ticket) {
+    if(reader_slot < 0) reader_slot = __atomic_fetch_add(&next_reader_slot, 1, __ATOMIC_RELAXED) % READER_SLOTS;
+    int parity = __atomic_load_n(&engine->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&engine->readers[reader_slot].count[parity], 1, __ATOMIC_SEQ_CST);
+    *ticket = reader_slot * 2 + parity;
+    return __atomic_load_n(&engine->current, __ATOMIC_SEQ_CST);
+}
+
+void leaveEngine(SPELL_ENGINE* engine, int ticket) {
+    __atomic_fetch_sub(&engine->readers[ticket >> 1].count[ticket & 1], 1, __ATOMIC_RELEASE);
+}
+
+// waits out every reader that entered before the last swap; two flips, since a reader may read
+// the parity just before one flip and register under it just after the slots were scanned
+void synchronizeEngine(SPELL_ENGINE* engine) {
+    for(int flip=0; flip<2; flip++) {
+        int parity = __atomic_fetch_add(&engine->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        for(int i=0; i<READER_SLOTS; i++)
+            while(__atomic_load_n(&engine->readers[i].count[parity], __ATOMIC_SEQ_CST)) usleep(100);
+    }
+}
+
+// changes whenever the dictionary, user dictionary or frequency file is edited, added or removed
+int64_t sourceStamp(const SOURCE_FILES* sources) {
+    uint64_t stamp = 0;     // unsigned, so the mixing wraps instead of overflowing
+    for(int i=0; i<3; i++) {
+        stamp *= 31;
+        if(sources->mtime[i]) stamp += (uint64_t)sources->mtime[i] + sources->size[i];
+        else stamp -= 1;
+    }
+    return (int64_t)stamp;
+}
+
+// maps config's snapshot, or builds from config's files (always when rebuild) and saves the
+// snapshot for next time. NULL when the dictionary can't be read.
+SPELL_DICTIONARY* loadEngineDictionary(const SPELL_CONFIG* config, THREAD_POOL* pool, bool rebuild) {
+    SPELL_DICTIONARY* dictionary = (SPELL_DICTIONARY*)calloc(1, sizeof(SPELL_DICTIONARY));
+    SOURCE_FILES sources;
+    statSources(config, &sources);      // taken first, so edits made during the build trigger another
+    dictionary->stamp = sourceStamp(&sources);
+    if(!rebuild && loadSnapshot(config, &sources, &dictionary->dict, &dictionary->filter))
+        fprintf(stderr, COLOR_GREEN "Dictionary snapshot %s mapped successfully\n" COLOR_RESET, config->snapshotPath);
+    else {
+        // the pointer DAWG is only the builder, lookups are served from its double-array copy
+        ARENA trie_arenas[N + 1] = {{ NULL, NULL }};      // one per first letter, the last one for the root
+        TRIE_NODE* root = createNode(&trie_arenas[N]);
+        dictionary->filter = loadDictionary(config, pool, root, trie_arenas);
+        if(dictionary->filter == NULL) {
+            fprintf(stderr, COLOR_RED "Dictionary %s is missing or empty\n" COLOR_RESET, config->dictPath);
+            arenaFree(&trie_arenas[N]);
+            free(dictionary);
+            return NULL;
+        }
+        dictionary->dict = buildDoubleArray(root);
+        for(int i=0; i<=N; i++) arenaFree(&trie_arenas[i]);
+        if(loadFrequencies(dictionary->dict, config->freqPath)) fprintf(stderr, COLOR_GREEN "Word frequencies loaded from %s\n" COLOR_RESET, config->freqPath);
+        rankCompletions(dictionary->dict);
+        if(saveSnapshot(config, &sources, dictionary->dict, dictionary->filter)) fprintf(stderr, COLOR_GREEN "Dictionary snapshot saved to %s\n" COLOR_RESET, config->snapshotPath);
+    }
+    buildSuggestIndex(&dictionary->index, dictionary->dict);
+    dictionary->cache = createSuggestionCache(config->cacheSize);
+    return dictionary;
+}
+
+void freeEngineDictionary(SPELL_DICTIONARY* dictionary) {
+    freeSuggestionCache(dictionary->cache);
+    freeSuggestIndex(&dictionary->index);
+    freeFilter(dictionary->filter);
+    freeDoubleArray(dictionary->dict);
+    free(dictionary);
+}
+
+// rebuilds the dictionary from the current files and publishes it, lookups keep running on the
+// old one meanwhile. False (old one kept) when the dictionary can't be read.
+// The build gets a pool of its own: runThreadPool holds engine->pool for a whole run, which
+// would stall server batches and --check for the length of the rebuild.
+bool reloadEngine(SPELL_ENGINE* engine) {
+    pthread_mutex_lock(&engine->reload);
+    THREAD_POOL* pool = createThreadPool(engine->config.threads);
+    SPELL_DICTIONARY* dictionary = loadEngineDictionary(&engine->config, pool, false);
+    freeThreadPool(pool);
+    if(dictionary) {
+        SPELL_DICTIONARY* old = __atomic_exchange_n(&engine->current, dictionary, __ATOMIC_SEQ_CST);
+        synchronizeEngine(engine);
+        freeEngineDictionary(old);
+        METRIC_ADD(METRIC_RELOADS, 1);
+    }
+    pthread_mutex_unlock(&engine->reload);
+    return dictionary != NULL;
+}
+
+void* watchEngine(void* arg) {
+    SPELL_ENGINE* engine = (SPELL_ENGINE*)arg;
+    pthread_mutex_lock(&engine->watchLock);
+    while(!engine->stopping) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += engine->config.reloadInterval;
+        pthread_cond_timedwait(&engine->watchStop, &engine->watchLock, &wake);
+        if(engine->stopping) break;
+        pthread_mutex_unlock(&engine->watchLock);
+        // only this thread and reloadEngine replace current, and both hold the reload lock
+        pthread_mutex_lock(&engine->reload);
+        SOURCE_FILES sources;
+        statSources(&engine->config, &sources);
+        bool changed = sourceStamp(&sources) != engine->current->stamp;
+        pthread_mutex_unlock(&engine->reload);
+        if(changed && reloadEngine(engine)) fprintf(stderr, COLOR_GREEN "Dictionary reloaded\n" COLOR_RESET);
+        pthread_mutex_lock(&engine->watchLock);
+    }
+    pthread_mutex_unlock(&engine->watchLock);
+    return NULL;
+}
+
+// loads config's dictionary (rebuilt from text when rebuild) and starts watching its files when
+// config asks for reloads. NULL when the dictionary can't be read.
+SPELL_ENGINE* createEngine(const SPELL_CONFIG* config, bool rebuild) {
+    SPELL_ENGINE* engine = (SPELL_ENGINE*)aligned_alloc(64, (sizeof(SPELL_ENGINE) + 63) & ~(size_t)63);
+    memset(engine, 0, sizeof(SPELL_ENGINE));
+    engine->config = *config;
+    engine->pool = createThreadPool(config->threads);
+    engine->current = loadEngineDictionary(config, engine->pool, rebuild);
+    if(engine->current == NULL) {
+        freeThreadPool(engine->pool);
+        free(engine);
+        return NULL;
+    }
+    pthread_mutex_init(&engine->reload, NULL);
+    pthread_mutex_init(&engine->watchLock, NULL);
+    pthread_cond_init(&engine->watchStop, NULL);
+    if(config->reloadInterval > 0 && !rebuild)
+        engine->watching = pthread_create(&engine->watcher, NULL, watchEngine, engine) == 0;
+    return engine;
+}
+
+void freeEngine(SPELL_ENGINE* engine) {
+    if(engine->watching) {
+        pthread_mutex_lock(&engine->watchLock);
+        engine->stopping = true;
+        pthread_cond_signal(&engine->watchStop);
+        pthread_mutex_unlock(&engine->watchLock);
+        pthread_join(engine->watcher, NULL);
+    }
+    freeThreadPool(engine->pool);
+    freeEngineDictionary(engine->current);
+    pthread_mutex_destroy(&engine->reload);
+    pthread_mutex_destroy(&engine->watchLock);
+    pthread_cond_destroy(&engine->watchStop);
+    free(engine);
+}
+
+// appends the lower case a..z words to config's user dictionary, running engines pick them up
+// on their next reload check. Returns no. of words added or -1.
+int addUserWords(const SPELL_CONFIG* config, char** words, int n) {
+    FILE* fp = fopen(config->userDictPath, "a");
+    if(fp == NULL) {
+        perror(COLOR_RED "Error opening user dictionary" COLOR_RESET);
+        return -1;
+    }
+    int added = 0;
+    for(int i=0; i<n; i++) {
+        int len = strlen(words[i]);
+        bool valid = len > 0 && len <= MAX_LENGTH;
+        for(int j=0; j<len && valid; j++) valid = words[i][j] >= 'a' && words[i][j] <= 'z';
+        if(!valid) {
+            fprintf(stderr, COLOR_RED "Skipping %s, words are 1 to %d lower case letters\n" COLOR_RESET, words[i], MAX_LENGTH);
+            continue;
+        }
+        fprintf(fp, "%s\n", words[i]);
+        added++;
+    }
+    return fclose(fp) == 0 ? added : -1;
+}
+
+bool engineCheckWord(SPELL_ENGINE* engine, const char* word) {
+    int ticket;
+    SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+    bool found = checkWord(dictionary->filter, dictionary->dict, word);
+    leaveEngine(engine, ticket);
+    return found;
+}
+
+int engineSuggest(SPELL_ENGINE* engine, char* word, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1]) {
+    int ticket;
+    SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+    int num_suggestions = suggestCached(dictionary->dict, &dictionary->index, dictionary->cache, word, suggestions);
+    leaveEngine(engine, ticket);
+    return num_suggestions;
+}
+
+int engineComplete(SPELL_ENGINE* engine, const char* prefix, int k, char completions[MAX_SUGGESTIONS][MAX_LENGTH + 1]) {
+    int ticket;
+    SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+    int num_completions = completeDoubleArray(dictionary->dict, prefix, k, completions);
+    leaveEngine(engine, ticket);
+    return num_completions;
+}
+
+// the whole file is checked against one dictionary
+long engineCheckFile(SPELL_ENGINE* engine, const char* path, FILE* out, long* n_words) {
+    int ticket;
+    SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+    long misspelled = part_file(path, engine->pool, dictionary->dict, dictionary->filter, &dictionary->index, dictionary->cache, out, n_words);
+    leaveEngine(engine, ticket);
+    return misspelled;
+}
+
+void engineCacheStats(SPELL_ENGINE* engine, FILE* out) {
+    int ticket;
+    printCacheStats(out, enterEngine(engine, &ticket)->cache);
+    leaveEngine(engine, ticket);
+}
+
+// Streaming: input is read in STREAM_CHUNK blocks and tokenized in place, so memory stays
+// bounded by one chunk whatever the input size. Words are lower cased and NUL terminated
+// inside the buffer itself and looked up from there without being copied.
+typedef struct tokenizer {
+    char* buffer;
+    long pos, len;          // next byte to scan, bytes held
+    long base;              // input offset of buffer[0]
+    bool eof;               // no more input after buffer[len - 1]
+    bool skipping;          // inside a word that grew past MAX_LENGTH
+} TOKENIZER;
+
+// next word of the buffered data, NULL when a new chunk is needed; a word touching the end
+// of a chunk is left in place unless the input has ended, refillTokenizer carries it over
+char* nextToken(TOKENIZER* tok, long* offset, int* wordLen) {
+    while(1) {
+        while(tok->pos < tok->len && !isalpha((unsigned char)tok->buffer[tok->pos])) {
+            tok->pos++;
+            tok->skipping = false;
+        }
+        if(tok->pos >= tok->len) return NULL;
+        long begin = tok->pos;
+        while(tok->pos < tok->len && isalpha((unsigned char)tok->buffer[tok->pos])) {
+            tok->buffer[tok->pos] = tolower((unsigned char)tok->buffer[tok->pos]);
+            tok->pos++;
+        }
+        if(tok->pos == tok->len && !tok->eof && !tok->skipping && tok->pos - begin <= MAX_LENGTH) {
+            tok->pos = begin;       // may continue in the next chunk
+            return NULL;
+        }
+        if(tok->skipping || tok->pos - begin > MAX_LENGTH) {
+            tok->skipping = tok->pos == tok->len;      // the long word may go on in the next chunk
+            continue;
+        }
+        // the delimiter after the word is overwritten, it has already been scanned
+        tok->buffer[tok->pos] = '\0';
+        *offset = tok->base + begin;
+        *wordLen = tok->pos - begin;
+        if(tok->pos < tok->len) tok->pos++;
+        return tok->buffer + begin;
+    }
+}
+
+// moves the unfinished tail to the front and reads the next chunk after it, false at end of input
+bool refillTokenizer(TOKENIZER* tok, int fd) {
+    if(tok->eof) return false;
+    long keep = tok->len - tok->pos;
+    memmove(tok->buffer, tok->buffer + tok->pos, keep);
+    tok->base += tok->pos;
+    tok->pos = 0;
+    tok->len = keep;
+    ssize_t n;
+    do n = read(fd, tok->buffer + keep, STREAM_CHUNK);
+    while(n < 0 && errno == EINTR);
+    if(n <= 0) tok->eof = true;
+    else tok->len += n;
+    return true;
+}
+
+// checks everything readable from fd, reporting misspellings to out as they are found, returns their count.
+// Each batch is checked against the dictionary current when it starts, so reloads apply mid stream.
+long engineCheckStream(SPELL_ENGINE* engine, int fd, FILE* out, long* n_words) {
+    TOKENIZER tok;
+    // room for a chunk, a carried over word and the terminator written after the last word
+    tok.buffer = (char*)malloc(STREAM_CHUNK + MAX_LENGTH + 2);
+    tok.pos = tok.len = tok.base = 0;
+    tok.eof = tok.skipping = false;
+    char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+    char line[REPORT_LINE_SIZE];
+    long misspelled = 0;
+    int len;
+    *n_words = 0;
+
+    const char* words[LOOKUP_BATCH];
+    long offsets[LOOKUP_BATCH];
+    uint64_t known[LOOKUP_BATCH / 64];
+
+    while(refillTokenizer(&tok, fd)) {
+        // tokens point into the buffer, so each batch is finished before the next refill moves it
+        bool more = true;
+        while(more) {
+            int n = 0;
+            while(n < LOOKUP_BATCH && (words[n] = nextToken(&tok, &offsets[n], &len)) != NULL) n++;
+            more = n == LOOKUP_BATCH;
+            *n_words += n;
+            int ticket;
+            SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+            checkWordsBatch(dictionary->filter, dictionary->dict, words, n, known);
+            for(int i=0; i<n; i++) {
+                if(known[i >> 6] >> (i & 63) & 1) continue;
+                misspelled++;
+                int num_suggestions = suggestCached(dictionary->dict, &dictionary->index, dictionary->cache, (char*)words[i], suggestions);
+                fwrite(line, 1, formatMisspelling(line, offsets[i], words[i], suggestions, num_suggestions), out);
+            }
+            leaveEngine(engine, ticket);
+        }
+        fflush(out);
+    }
+    free(tok.buffer);
+    return misspelled;
+}
+
+// Benchmark (--bench): dictionary load, lookup and suggestion timings written as JSON,
+// so two runs can be compared and a regression gated on
+double monotonicSeconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+long peakRssKb(void) {
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;     // kilobytes on linux
+}
+
+int compareDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// p-th quantile of n samples, sorts them in place
+double percentile(double* samples, int n, double p) {
+    qsort(samples, n, sizeof(double), compareDouble);
+    return samples[(int)(p * (n - 1) + 0.5)];
+}
+
+typedef struct word_list {
+    char (*words)[MAX_LENGTH + 1];
+    int n;
+} WORD_LIST;
+
+void collectWord(const char* word, int len, void* ctx) {
+    WORD_LIST* list = (WORD_LIST*)ctx;
+    memcpy(list->words[list->n++], word, len + 1);
+}
+
+// a random dictionary word pushed edits random substitutions, deletions or insertions
+// away, retried until it is no longer a dictionary word
+void misspellWord(const DA_TRIE* da, const WORD_LIST* dict, int edits, uint64_t* seed, char* out) {
+    do {
+        strcpy(out, dict->words[xorshift64(seed) % dict->n]);
+        for(int e=0; e<edits; e++) {
+            int len = strlen(out), pos = xorshift64(seed) % (len + 1), op = xorshift64(seed) % 3;
+            char c = 'a' + xorshift64(seed) % 26;
+            if(op == 0 && pos < len) out[pos] = c;
+            else if(op == 1 && pos < len && len > 1) memmove(out + pos, out + pos + 1, len - pos);
+            else if(len < MAX_LENGTH) {
+                memmove(out + pos + 1, out + pos, len - pos + 1);
+                out[pos] = c;
+            }
+        }
+    } while(searchDoubleArray(da, out));
+}
+
+void benchLookups(FILE* out, const char* mix, double hitRatio, const BLOOM_FILTER* filter, const DA_TRIE* da, const WORD_LIST* dict, uint64_t* seed) {
+    char (*words)[MAX_LENGTH + 1] = malloc(BENCH_WORDS * sizeof(*words));
+    const char** pointers = malloc(BENCH_WORDS * sizeof(char*));
+    for(int i=0; i<BENCH_WORDS; i++) {
+        if(xorshift64(seed) % 1000 < hitRatio * 1000) strcpy(words[i], dict->words[xorshift64(seed) % dict->n]);
+        else misspellWord(da, dict, 1, seed, words[i]);
+        pointers[i] = words[i];
+    }
+
+    int n_groups = BENCH_WORDS / BENCH_GROUP, found = 0;
+    double* samples = malloc(n_groups * sizeof(double));
+    double begin = monotonicSeconds();
+    for(int g=0; g<n_groups; g++) {
+        double start = monotonicSeconds();
+        for(int i=g*BENCH_GROUP; i<(g+1)*BENCH_GROUP; i++) found += checkWord(filter, da, words[i]);
+        samples[g] = (monotonicSeconds() - start) / BENCH_GROUP * 1e9;
+    }
+    double single = monotonicSeconds() - begin;
+
+    uint64_t* known = malloc(((BENCH_WORDS + 63) / 64) * sizeof(uint64_t));
+    begin = monotonicSeconds();
+    checkWordsBatch(filter, da, pointers, n_groups * BENCH_GROUP, known);
+    double batched = monotonicSeconds() - begin;
+
+    fprintf(out, "    {\"mix\": \"%s\", \"hit_ratio\": %.2f, \"words\": %d, \"found\": %d, \"ops_per_sec\": %.0f, \"batched_ops_per_sec\": %.0f, ",
+            mix, hitRatio, n_groups * BENCH_GROUP, found, n_groups * BENCH_GROUP / single, n_groups * BENCH_GROUP / batched);
+    fprintf(out, "\"p50_ns\": %.1f, \"p99_ns\": %.1f}", percentile(samples, n_groups, 0.50), percentile(samples, n_groups, 0.99));
+    free(known);
+    free(samples);
+    free(pointers);
+    free(words);
+}
+
+// prefixes of random dictionary words, completed to the top MAX_SUGGESTIONS
+void benchCompletions(FILE* out, int length, DA_TRIE* da, const WORD_LIST* dict, uint64_t* seed) {
+    double samples[BENCH_QUERIES], total = 0;
+    long returned = 0;
+    char prefix[MAX_LENGTH + 1], completions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+    for(int q=0; q<BENCH_QUERIES; q++) {
+        const char* word = dict->words[xorshift64(seed) % dict->n];
+        snprintf(prefix, sizeof(prefix), "%.*s", length, word);
+        double start = monotonicSeconds();
+        returned += completeDoubleArray(da, prefix, MAX_SUGGESTIONS, completions);
+        samples[q] = (monotonicSeconds() - start) * 1e6;
+        total += samples[q];
+    }
+    fprintf(out, "    {\"prefix_length\": %d, \"queries\": %d, \"mean_completions\": %.2f, \"mean_us\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f}",
+            length, BENCH_QUERIES, (double)returned / BENCH_QUERIES, total / BENCH_QUERIES,
+            percentile(samples, BENCH_QUERIES, 0.50), percentile(samples, BENCH_QUERIES, 0.99));
+}
+
+void benchSuggestions(FILE* out, int edits, DA_TRIE* da, SUGGEST_INDEX* index, const WORD_LIST* dict, uint64_t* seed) {
+    double samples[BENCH_QUERIES], total = 0;
+    long returned = 0;
+    char word[MAX_LENGTH + 1], suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+    for(int q=0; q<BENCH_QUERIES; q++) {
+        misspellWord(da, dict, edits, seed, word);
+        double start = monotonicSeconds();
+        returned += suggest(da, index, word, suggestions);
+        samples[q] = (monotonicSeconds() - start) * 1e6;
+        total += samples[q];
+    }
+    fprintf(out, "    {\"edits\": %d, \"queries\": %d, \"mean_suggestions\": %.2f, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f}",
+            edits, BENCH_QUERIES, (double)returned / BENCH_QUERIES, total / BENCH_QUERIES,
+            percentile(samples, BENCH_QUERIES, 0.50), percentile(samples, BENCH_QUERIES, 0.99));
+}
+
+// builds the dictionary from text, maps it back from a fresh snapshot and times queries against
+// the mapped copy, the way a normal run serves them
+bool runBenchmark(FILE* out, const SPELL_CONFIG* config) {
+    double start = monotonicSeconds();
+    SOURCE_FILES sources;
+    statSources(config, &sources);
+    ARENA trie_arenas[N + 1] = {{ NULL, NULL }};
+    TRIE_NODE* root = createNode(&trie_arenas[N]);
+    THREAD_POOL* pool = createThreadPool(config->threads);
+    BLOOM_FILTER* built_filter = loadDictionary(config, pool, root, trie_arenas);
+    freeThreadPool(pool);
+    if(built_filter == NULL) {
+        fprintf(stderr, COLOR_RED "Dictionary %s is missing or empty\n" COLOR_RESET, config->dictPath);
+        arenaFree(&trie_arenas[N]);
+        return false;
+    }
+    DA_TRIE* built_da = buildDoubleArray(root);
+    size_t trie_bytes = 0;
+    for(int i=0; i<=N; i++) {
+        trie_bytes += arenaSize(&trie_arenas[i]);
+        arenaFree(&trie_arenas[i]);
+    }
+    loadFrequencies(built_da, config->freqPath);
+    rankCompletions(built_da);
+    double build_ms = (monotonicSeconds() - start) * 1e3;
+    long build_rss = peakRssKb();
+    bool saved = saveSnapshot(config, &sources, built_da, built_filter);
+    freeDoubleArray(built_da);
+    freeFilter(built_filter);
+
+    DA_TRIE* da;
+    BLOOM_FILTER* filter;
+    start = monotonicSeconds();
+    if(!saved || !loadSnapshot(config, &sources, &da, &filter)) {
+        fprintf(stderr, COLOR_RED "Benchmark needs a readable snapshot at %s\n" COLOR_RESET, config->snapshotPath);
+        return false;
+    }
+    double map_ms = (monotonicSeconds() - start) * 1e3;
+    SUGGEST_INDEX index;
+    start = monotonicSeconds();
+    buildSuggestIndex(&index, da);
+    double index_ms = (monotonicSeconds() - start) * 1e3;
+
+    WORD_LIST dict = { malloc((size_t)da->nWords * sizeof(*dict.words)), 0 };
+    char prefix[MAX_LENGTH + 1];
+    forEachWordDoubleArray(da, da->root, prefix, 0, collectWord, &dict);
+    uint64_t seed = 88172645463325252ULL;      // fixed, so every run times the same words
+
+    const char* engine = SUGGEST_ENGINE == ENGINE_BK_TREE ? "bk_tree" : SUGGEST_ENGINE == ENGINE_BUCKETS ? "buckets" : "trie";
+    fprintf(out, "{\n  \"engine\": \"%s\",\n  \"dictionary_words\": %d,\n  \"frequencies\": %s,\n", engine, da->nWords, da->freq ? "true" : "false");
+    fprintf(out, "  \"load\": {\"build_ms\": %.1f, \"snapshot_map_ms\": %.3f, \"suggest_index_ms\": %.1f},\n", build_ms, map_ms, index_ms);
+    fprintf(out, "  \"memory\": {\"pointer_trie_bytes\": %zu, \"double_array_bytes\": %zu, \"suggest_index_bytes\": %zu},\n",
+            trie_bytes, sizeDoubleArray(da), sizeSuggestIndex(&index));
+    fprintf(out, "  \"lookup\": [\n");
+    benchLookups(out, "hit_heavy", 0.9, filter, da, &dict, &seed);
+    fprintf(out, ",\n");
+    benchLookups(out, "miss_heavy", 0.1, filter, da, &dict, &seed);
+    fprintf(out, "\n  ],\n  \"suggest\": [\n");
+    for(int edits=1; edits<=MAX_EDIT_DISTANCE; edits++) {
+        benchSuggestions(out, edits, da, &index, &dict, &seed);
+        fprintf(out, edits < MAX_EDIT_DISTANCE ? ",\n" : "\n");
+    }
+    fprintf(out, "  ],\n  \"complete\": [\n");
+    for(int length=1; length<=3; length++) {
+        benchCompletions(out, length, da, &dict, &seed);
+        fprintf(out, length < 3 ? ",\n" : "\n");
+    }
+    fprintf(out, "  ],\n  \"peak_rss_kb\": {\"after_build\": %ld, \"end\": %ld}", build_rss, peakRssKb());
+#if SPELL_METRICS
+    fprintf(out, ",\n  \"metrics\": ");
+    dumpMetrics(out, false, NULL);
+    fprintf(out, "}\n");
+#else
+    fprintf(out, "\n}\n");
+#endif
+    free(dict.words);
+    freeSuggestIndex(&index);
+    freeFilter(filter);
+    freeDoubleArray(da);
+    return true;
+}
+
+// Self tuning (mode 3): sweeps the filter settings, then cache size and thread count, over a sample
+// corpus. The fastest setting wins; among settings within TUNE_TOLERANCE of it the smallest does.
+static const double tune_fprs[] = { 0.05, 0.02, 0.01, 0.005, 0.001 };
+static const int tune_k_offsets[] = { -2, -1, 0, 1 };      // around the optimal k of each rate
+static const int tune_cache_sizes[] = { 256, 1024, 4096, 16384 };
+static const int tune_threads[] = { 1, 2, 4, 8 };
+
+// the corpus as lower cased words, the way the checker splits it
+bool readCorpusWords(const char* path, WORD_LIST* list) {
+    FILE* fp = fopen(path, "r");
+    if(fp == NULL) return false;
+    int cap = 1024, len = 0, c;
+    list->words = malloc(cap * sizeof(*list->words));
+    list->n = 0;
+    do {
+        c = fgetc(fp);
+        if(c != EOF && isalpha(c)) {
+            if(len < MAX_LENGTH) list->words[list->n][len++] = tolower(c);
+        }
+        else if(len > 0) {
+            list->words[list->n++][len] = '\0';
+            len = 0;
+            if(list->n == cap) list->words = realloc(list->words, (cap *= 2) * sizeof(*list->words));
+        }
+    } while(c != EOF);
+    fclose(fp);
+    return true;
+}
+
+// corpus words checked per second, rechecking the corpus until TUNE_MIN_SECONDS have passed.
+// Each lookup enters the engine like engineCheckWord, so a reload is never held up by the sweep.
+double corpusThroughput(const BLOOM_FILTER* filter, SPELL_ENGINE* engine, const WORD_LIST* corpus) {
+    long checked = 0;
+    volatile long found = 0;    // keeps the lookups from being optimised away
+    double start = monotonicSeconds(), elapsed;
+    do {
+        for(int i=0; i<corpus->n; i++) {
+            int ticket;
+            found += checkWord(filter, enterEngine(engine, &ticket)->dict, corpus->words[i]);
+            leaveEngine(engine, ticket);
+        }
+        checked += corpus->n;
+    } while((elapsed = monotonicSeconds() - start) < TUNE_MIN_SECONDS && corpus->n > 0);
+    return checked / elapsed;
+}
+
+// true when a (throughput, size) point beats best: clearly faster, or as fast and smaller
+bool tuneBetter(double throughput, double size, double best_throughput, double best_size) {
+    if(throughput > best_throughput * (1 + TUNE_TOLERANCE)) return true;
+    return throughput >= best_throughput * (1 - TUNE_TOLERANCE) && size < best_size;
+}
+
+// updates config with the best settings found on corpus, false when the corpus can't be read.
+// The sweep takes minutes, so engine is entered per measurement rather than held throughout;
+// candidate filters are built from the words as they were when it started.
+bool tuneConfig(const char* corpus_path, SPELL_ENGINE* engine, SPELL_CONFIG* config) {
+    WORD_LIST corpus, dict;
+    if(!readCorpusWords(corpus_path, &corpus)) {
+        perror(COLOR_RED "Error opening sample corpus" COLOR_RESET);
+        return false;
+    }
+    int ticket;
+    SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+    DA_TRIE* da = dictionary->dict;
+    int n_words = da->nWords;
+    dict.words = malloc((size_t)n_words * sizeof(*dict.words));
+    dict.n = 0;
+    char prefix[MAX_LENGTH + 1];
+    forEachWordDoubleArray(da, da->root, prefix, 0, collectWord, &dict);
+    leaveEngine(engine, ticket);
+    printf(COLOR_CYAN "Tuning on %d words of %s\n\n%-8s %-3s %-8s %10s %12s %14s\n" COLOR_RESET,
+           corpus.n, corpus_path, "fpr", "k", "blocked", "size (KB)", "measured fpr", "words/sec");
+
+    double best_throughput = 0, best_size = 0;
+    for(size_t f=0; f<sizeof(tune_fprs)/sizeof(tune_fprs[0]); f++) {
+        for(int blocked=0; blocked<=1; blocked++) {
+            int optimal_k = optimalHashes(n_words, tune_fprs[f]);
+            for(size_t o=0; o<sizeof(tune_k_offsets)/sizeof(tune_k_offsets[0]); o++) {
+                int k = optimal_k + tune_k_offsets[o];
+                if(k < 1) continue;
+                BLOOM_FILTER* filter = createFilter(n_words, tune_fprs[f], k, blocked);
+                for(int i=0; i<dict.n; i++) insertFilter(filter, dict.words[i]);
+                double throughput = corpusThroughput(filter, engine, &corpus), size = sizeFilter(filter);
+                double fpr = measureFalsePositiveRate(filter, enterEngine(engine, &ticket)->dict, TUNE_FPR_SAMPLES);
+                leaveEngine(engine, ticket);
+                printf("%-8g %-3d %-8s %10.1f %11.3f%% %14.0f\n", tune_fprs[f], k, blocked ? "yes" : "no", size / 1e3,
+                       fpr * 100, throughput);
+                if(best_throughput == 0 || tuneBetter(throughput, size, best_throughput, best_size)) {
+                    best_throughput = throughput;
+                    best_size = size;
+                    config->filterFpr = tune_fprs[f];
+                    config->filterK = k;
+                    config->filterBlocked = blocked;
+                }
+                freeFilter(filter);
+            }
+        }
+    }
+
+    // cache and threads are timed on whole --check runs with the chosen filter and a cold cache
+    BLOOM_FILTER* filter = createFilter(n_words, config->filterFpr, config->filterK, config->filterBlocked);
+    for(int i=0; i<dict.n; i++) insertFilter(filter, dict.words[i]);
+    FILE* sink = fopen("/dev/null", "w");
+    printf(COLOR_CYAN "\n%-8s %-10s %10s %14s\n" COLOR_RESET, "threads", "cache", "size (KB)", "words/sec");
+    best_throughput = 0;
+    for(size_t t=0; t<sizeof(tune_threads)/sizeof(tune_threads[0]) && sink; t++) {
+        THREAD_POOL* pool = createThreadPool(tune_threads[t]);
+        for(size_t c=0; c<sizeof(tune_cache_sizes)/sizeof(tune_cache_sizes[0]); c++) {
+            SUGGESTION_CACHE* cache = createSuggestionCache(tune_cache_sizes[c]);
+            long checked;
+            // one corpus run sees one dictionary, like engineCheckFile
+            dictionary = enterEngine(engine, &ticket);
+            double start = monotonicSeconds();
+            long misspelled = part_file(corpus_path, pool, dictionary->dict, filter, &dictionary->index, cache, sink, &checked);
+            double throughput = misspelled < 0 ? 0 : checked / (monotonicSeconds() - start);
+            leaveEngine(engine, ticket);
+            double size = (double)tune_cache_sizes[c] * (sizeof(struct LRUCacheQueueNode) + sizeof(struct LRUCacheMapNode));
+            printf("%-8d %-10d %10.1f %14.0f\n", tune_threads[t], tune_cache_sizes[c], size / 1e3, throughput);
+            // fewer threads count as smaller, so they win near ties
+            if(best_throughput == 0 || tuneBetter(throughput, size * tune_threads[t], best_throughput, best_size)) {
+                best_throughput = throughput;
+                best_size = size * tune_threads[t];
+                config->cacheSize = tune_cache_sizes[c];
+                config->threads = tune_threads[t];
+            }
+            freeSuggestionCache(cache);
+        }
+        freeThreadPool(pool);
+    }
+    if(sink) fclose(sink);
+    freeFilter(filter);
+    free(corpus.words);
+    free(dict.words);
+    return true;
+}
+
+// Server (--serve): one warm engine answering line delimited requests on a Unix domain socket.
+//   check <word> [word ...]   ->  "1" or "0" per word, space separated
+//   suggest <word>            ->  comma separated suggestions, empty line when there are none
+//   complete <prefix> [k]     ->  comma separated top k (default and at most MAX_SUGGESTIONS) completions
+//   metrics [prometheus]      ->  dumpMetrics as one JSON line, or Prometheus lines up to a blank one
+// Anything else gets "error <reason>". Replies come back in request order on each connection.
+// A single thread polls every connection and takes all complete lines that have arrived as one
+// batch, which the engine's pool answers in parallel against one dictionary. Requests arriving
+// while a batch runs form the next one, so batches grow with load and stay single under light load.
+typedef struct server_conn {
+    int fd;
+    char* in;               // bytes received, complete lines are cut off the front after each batch
+    size_t inLen, inCap;
+    char* out;              // replies not yet written
+    size_t outLen, outCap;
+    bool closing;           // peer hung up or sent garbage, close once out is flushed
+} SERVER_CONN;
+
+typedef struct server_request {
+    int conn;
+    char* line;             // NUL terminated in place inside the connection's buffer
+    size_t replyOffset, replyLen;
+} SERVER_REQUEST;
+
+typedef struct server_job {
+    SPELL_DICTIONARY* dictionary;
+    SERVER_REQUEST* requests;
+    int start, end;
+    char* reply;            // replies of requests start..end-1, back to back
+    size_t replyLen, replyCap;
+} SERVER_JOB;
+
+volatile sig_atomic_t server_stop = 0;
+
+void stopServer(int sig) {
+    (void) sig;
+    server_stop = 1;
+}
+
+void appendBuffer(char** buffer, size_t* len, size_t* cap, const char* data, size_t n) {
+    if(*len + n + 1 > *cap) {
+        *cap = greater(4096, 2 * (*len + n + 1));
+        *buffer = (char*)realloc(*buffer, *cap);
+    }
+    memcpy(*buffer + *len, data, n);
+    *len += n;
+}
+
+// lower cases a token in place, false when it can't be a dictionary word
+bool normalizeWord(char* word) {
+    int len = 0;
+    for(; word[len]; len++) {
+        if(!isalpha((unsigned char)word[len])) return false;
+        word[len] = tolower((unsigned char)word[len]);
+    }
+    return len > 0 && len <= MAX_LENGTH;
+}
+
+void answerRequest(SERVER_JOB* job, SERVER_REQUEST* request) {
+    SPELL_DICTIONARY* dictionary = job->dictionary;
+    char* save = NULL;
+    char* command = strtok_r(request->line, " \t\r", &save);
+    request->replyOffset = job->replyLen;
+    if(command && !strcmp(command, "check")) {
+        const char* words[LOOKUP_BATCH];
+        bool valid[LOOKUP_BATCH];
+        uint64_t known[LOOKUP_BATCH / 64];
+        int n = 0, total = 0;
+        char* word = strtok_r(NULL, " \t\r", &save);
+        while(word || n > 0) {
+            if(word) {
+                valid[n] = normalizeWord(word);
+                words[n] = valid[n] ? word : "";
+                n++;
+                word = strtok_r(NULL, " \t\r", &save);
+            }
+            if(n == LOOKUP_BATCH || (!word && n > 0)) {
+                checkWordsBatch(dictionary->filter, dictionary->dict, words, n, known);
+                for(int i=0; i<n; i++, total++) {
+                    const char* answer = valid[i] && (known[i >> 6] >> (i & 63) & 1) ? "1" : "0";
+                    if(total) appendBuffer(&job->reply, &job->replyLen, &job->replyCap, " ", 1);
+                    appendBuffer(&job->reply, &job->replyLen, &job->replyCap, answer, 1);
+                }
+                n = 0;
+            }
+        }
+    }
+    else if(command && !strcmp(command, "complete")) {
+        char* prefix = strtok_r(NULL, " \t\r", &save);
+        char* count = strtok_r(NULL, " \t\r", &save);
+        if(prefix && normalizeWord(prefix)) {
+            char completions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+            int num_completions = completeDoubleArray(dictionary->dict, prefix, count ? atoi(count) : MAX_SUGGESTIONS, completions);
+            for(int i=0; i<num_completions; i++) {
+                if(i) appendBuffer(&job->reply, &job->replyLen, &job->replyCap, ",", 1);
+                appendBuffer(&job->reply, &job->replyLen, &job->replyCap, completions[i], strlen(completions[i]));
+            }
+        }
+    }
+    else if(command && !strcmp(command, "suggest")) {
+        char* word = strtok_r(NULL, " \t\r", &save);
+        if(word && normalizeWord(word)) {
+            char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+            int num_suggestions = suggestCached(dictionary->dict, &dictionary->index, dictionary->cache, word, suggestions);
+            for(int i=0; i<num_suggestions; i++) {
+                if(i) appendBuffer(&job->reply, &job->replyLen, &job->replyCap, ",", 1);
+                appendBuffer(&job->reply, &job->replyLen, &job->replyCap, suggestions[i], strlen(suggestions[i]));
+            }
+        }
+    }
+#if SPELL_METRICS
+    else if(command && !strcmp(command, "metrics")) {
+        // JSON by default, Prometheus text over several lines when asked for
+        char* format = strtok_r(NULL, " \t\r", &save);
+        char* text = NULL;
+        size_t len = 0;
+        FILE* fp = open_memstream(&text, &len);
+        if(fp) {
+            CACHE_COUNTS counts = cacheCounts(dictionary->cache);
+            dumpMetrics(fp, format && !strcmp(format, "prometheus"), &counts);
+            fclose(fp);
+            appendBuffer(&job->reply, &job->replyLen, &job->replyCap, text, len - 1);    // newline added below
+        }
+        free(text);
+    }
+#endif
+    else {
+        const char* error = "error unknown command, use check, suggest, complete or metrics";
+        appendBuffer(&job->reply, &job->replyLen, &job->replyCap, error, strlen(error));
+    }
+    appendBuffer(&job->reply, &job->replyLen, &job->replyCap, "\n", 1);
+    request->replyLen = job->replyLen - request->replyOffset;
+}
+
+void* serverJob(void* arg) {
+    SERVER_JOB* job = (SERVER_JOB*)arg;
+    for(int i=job->start; i<job->end; i++) answerRequest(job, &job->requests[i]);
+    return NULL;
+}
+
+// creates, binds and listens on path, replacing a stale socket left by an earlier run
+int listenSocket(const char* path) {
+    struct sockaddr_un addr;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, COLOR_RED "Socket path %s is too long\n" COLOR_RESET, path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    struct stat sock_stat;
+    if(stat(path, &sock_stat) == 0 && S_ISSOCK(sock_stat.st_mode)) unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror(COLOR_RED "Error opening server socket" COLOR_RESET);
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+// reads what fd has, false once the connection should be dropped
+bool readConn(SERVER_CONN* conn) {
+    while(1) {
+        if(conn->inLen + 4096 > conn->inCap) {
+            conn->inCap = greater(8192, 2 * conn->inCap);
+            conn->in = (char*)realloc(conn->in, conn->inCap);
+        }
+        ssize_t n = read(conn->fd, conn->in + conn->inLen, conn->inCap - conn->inLen - 1);
+        if(n > 0) {
+            conn->inLen += n;
+            continue;
+        }
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        conn->closing = true;       // end of stream, lines already received are still answered
+        return true;
+    }
+}
+
+// writes as much of the pending replies as the socket takes, false when the peer is gone
+bool flushConn(SERVER_CONN* conn) {
+    size_t done = 0;
+    while(done < conn->outLen) {
+        ssize_t n = send(conn->fd, conn->out + done, conn->outLen - done, MSG_NOSIGNAL);
+        if(n > 0) done += n;
+        else if(n < 0 && errno == EINTR) continue;
+        else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        else return false;
+    }
+    memmove(conn->out, conn->out + done, conn->outLen - done);
+    conn->outLen -= done;
+    return true;
+}
+
+// serves engine on path until SIGINT or SIGTERM, returns false when the socket can't be opened
+bool runServer(SPELL_ENGINE* engine, const char* path) {
+    int listen_fd = listenSocket(path);
+    if(listen_fd < 0) return false;
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    fprintf(stderr, COLOR_GREEN "Serving on %s with %d threads\n" COLOR_RESET, path, engine->pool->nThreads);
+
+    int n_conns = 0, conn_cap = 16, request_cap = 256;
+    SERVER_CONN* conns = (SERVER_CONN*)malloc(conn_cap * sizeof(SERVER_CONN));
+    struct pollfd* fds = (struct pollfd*)malloc((conn_cap + 1) * sizeof(struct pollfd));
+    SERVER_REQUEST* requests = (SERVER_REQUEST*)malloc(request_cap * sizeof(SERVER_REQUEST));
+    SERVER_JOB* jobs = (SERVER_JOB*)calloc(engine->pool->nThreads, sizeof(SERVER_JOB));
+    size_t* consumed = (size_t*)malloc(conn_cap * sizeof(size_t));
+
+    while(!server_stop) {
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for(int i=0; i<n_conns; i++) {
+            fds[i + 1].fd = conns[i].fd;
+            fds[i + 1].events = (conns[i].closing ? 0 : POLLIN) | (conns[i].outLen ? POLLOUT : 0);
+        }
+        if(poll(fds, n_conns + 1, -1) < 0) {
+            if(errno == EINTR) continue;
+            perror(COLOR_RED "Error polling connections" COLOR_RESET);
+            break;
+        }
+        for(int i=0; i<n_conns; i++) {
+            if(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) readConn(&conns[i]);
+            if(fds[i + 1].revents & POLLOUT && !flushConn(&conns[i])) {
+                conns[i].closing = true;
+                conns[i].outLen = 0;
+            }
+        }
+        if(fds[0].revents & POLLIN) {
+            int fd;
+            while((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                if(n_conns == conn_cap) {
+                    conn_cap *= 2;
+                    conns = (SERVER_CONN*)realloc(conns, conn_cap * sizeof(SERVER_CONN));
+                    fds = (struct pollfd*)realloc(fds, (conn_cap + 1) * sizeof(struct pollfd));
+                    consumed = (size_t*)realloc(consumed, conn_cap * sizeof(size_t));
+                }
+                memset(&conns[n_conns], 0, sizeof(SERVER_CONN));
+                conns[n_conns++].fd = fd;
+            }
+        }
+
+        // every complete line received so far is one request of this batch
+        int n_requests = 0;
+        for(int i=0; i<n_conns; i++) {
+            SERVER_CONN* conn = &conns[i];
+            size_t pos = 0;
+            char* newline;
+            while(pos < conn->inLen && (newline = (char*)memchr(conn->in + pos, '\n', conn->inLen - pos)) != NULL) {
+                if(n_requests == request_cap) requests = (SERVER_REQUEST*)realloc(requests, (request_cap *= 2) * sizeof(SERVER_REQUEST));
+                *newline = '\0';
+                requests[n_requests].conn = i;
+                requests[n_requests++].line = conn->in + pos;
+                pos = newline - conn->in + 1;
+            }
+            consumed[i] = pos;
+            if(conn->inLen - pos > SERVER_LINE_MAX) {
+                const char* error = "error line too long\n";
+                appendBuffer(&conn->out, &conn->outLen, &conn->outCap, error, strlen(error));
+                conn->closing = true;
+                consumed[i] = conn->inLen;
+            }
+        }
+
+        if(n_requests > 0) {
+            METRIC_TIMER(batch_start);
+            int ticket;
+            SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+            int n_jobs = smaller(engine->pool->nThreads, n_requests);
+            for(int j=0; j<n_jobs; j++) {
+                jobs[j].dictionary = dictionary;
+                jobs[j].requests = requests;
+                jobs[j].start = (long)n_requests * j / n_jobs;
+                jobs[j].end = (long)n_requests * (j + 1) / n_jobs;
+                jobs[j].replyLen = 0;
+            }
+            if(n_jobs == 1) serverJob(&jobs[0]);        // a lone request skips the pool hand off
+            else runThreadPool(engine->pool, serverJob, jobs, sizeof(SERVER_JOB), n_jobs);
+            leaveEngine(engine, ticket);
+            for(int j=0; j<n_jobs; j++) {
+                for(int r=jobs[j].start; r<jobs[j].end; r++) {
+                    SERVER_CONN* conn = &conns[requests[r].conn];
+                    appendBuffer(&conn->out, &conn->outLen, &conn->outCap, jobs[j].reply + requests[r].replyOffset, requests[r].replyLen);
+                }
+            }
+            METRIC_ADD(METRIC_REQUESTS, n_requests);
+            METRIC_RECORD(HIST_SERVER_BATCH_SIZE, n_requests);
+            METRIC_ELAPSED(HIST_SERVER_BATCH, batch_start);
+        }
+
+        // drop answered lines, flush replies and close finished connections
+        int kept = 0;
+        for(int i=0; i<n_conns; i++) {
+            SERVER_CONN* conn = &conns[i];
+            if(consumed[i]) {       // in is still NULL on a connection that has sent nothing
+                memmove(conn->in, conn->in + consumed[i], conn->inLen - consumed[i]);
+                conn->inLen -= consumed[i];
+            }
+            if(conn->outLen && !flushConn(conn)) {
+                conn->closing = true;
+                conn->outLen = 0;
+            }
+            if(conn->closing && conn->outLen == 0) {
+                close(conn->fd);
+                free(conn->in);
+                free(conn->out);
+                continue;
+            }
+            conns[kept++] = *conn;
+        }
+        n_conns = kept;
+    }
+
+    for(int i=0; i<n_conns; i++) {
+        close(conns[i].fd);
+        free(conns[i].in);
+        free(conns[i].out);
+    }
+    for(int j=0; j<engine->pool->nThreads; j++) free(jobs[j].reply);
+    free(jobs);
+    free(requests);
+    free(consumed);
+    free(fds);
+    free(conns);
+    close(listen_fd);
+    unlink(path);
+    fprintf(stderr, COLOR_GREEN "Server stopped\n" COLOR_RESET);
+    return true;
+}
+
+// Client (--client): sends each line of in to the server and prints the replies to out, one
+// request in flight at a time, then reports the round trip latencies to stderr
+bool runClient(const char* path, FILE* in, FILE* out) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror(COLOR_RED "Error connecting to server" COLOR_RESET);
+        if(fd >= 0) close(fd);
+        return false;
+    }
+    FILE* replies = fdopen(dup(fd), "r");
+    char* line = NULL;
+    char* reply = NULL;
+    size_t line_cap = 0, reply_cap = 0;
+    int n = 0, cap = 1024;
+    double* samples = (double*)malloc(cap * sizeof(double));
+    ssize_t len;
+    bool ok = true;
+    while((len = getline(&line, &line_cap, in)) > 0) {
+        if(line[len - 1] != '\n') {
+            line = (char*)realloc(line, len + 2);
+            line[len++] = '\n';
+        }
+        double start = monotonicSeconds();
+        if(send(fd, line, len, MSG_NOSIGNAL) != len || getline(&reply, &reply_cap, replies) < 0) {
+            fprintf(stderr, COLOR_RED "Server closed the connection\n" COLOR_RESET);
+            ok = false;
+            break;
+        }
+        // a Prometheus metrics reply runs over several lines, up to a blank one
+        bool multiline = !strncmp(reply, "# ", 2);
+        fputs(reply, out);
+        while(multiline && strcmp(reply, "\n") && getline(&reply, &reply_cap, replies) >= 0) fputs(reply, out);
+        if(n == cap) samples = (double*)realloc(samples, (cap *= 2) * sizeof(double));
+        samples[n++] = (monotonicSeconds() - start) * 1e6;
+    }
+    if(n > 0) {
+        double total = 0;
+        for(int i=0; i<n; i++) total += samples[i];
+        fprintf(stderr, COLOR_CYAN "%d requests, mean %.1f us, p50 %.1f us, p99 %.1f us\n" COLOR_RESET,
+                n, total / n, percentile(samples, n, 0.50), percentile(samples, n, 0.99));
+    }
+    free(samples);
+    free(line);
+    free(reply);
+    fclose(replies);
+    close(fd);
+    return ok;
+}
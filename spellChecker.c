@@ -5,102 +5,144 @@
 # include <string.h>    // for string manipulation
 # include <ctype.h>     // for formatting
 # include <math.h>      // for some math functions
+# include <time.h>      // for timing the batch mode, comparison mode and benchmark
+# include <errno.h>
 # include <pthread.h>   // for multithreading
-# include <windows.h>   // for computational analysis and comparision analysis
+# if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h> // for the vectorized bloom filter probe, picked at run time
+# endif
+# include <fcntl.h>     // for opening the dictionary snapshot
+# include <unistd.h>
+# include <sys/mman.h>  // for mapping the dictionary snapshot
+# include <sys/stat.h>
+# include <sys/resource.h>  // for the benchmark's peak memory
+# include <sys/socket.h>    // for the --serve daemon and its client
+# include <sys/un.h>
+# include <poll.h>
+# include <signal.h>
 # include "spell.h"     // our header file with bloom filter, trie and lru cache etc functionality
 
 // global variables
 
-// analysis/development functions
-int suggest(char *word, struct LRUCache* obj, char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1]){
-    char dict_word[MAX_LENGTH];
-    double temp_JaroWinklerValue = 0;
-    int temp_LevenshteinValue = INT_MAX;
-    FILE *dict_ptr = fopen(DICT_FILE, "r");
-    if(dict_ptr == NULL) {
-        perror(COLOR_RED "Error loading dictionary for suggestions\n" COLOR_RESET);
-        exit(1);
+int main(int argc, char* argv[]) {
+    // status messages go to stderr so the --check report on stdout can be piped
+    bool build_only = argc > 1 && !strcmp(argv[1], "--build-snapshot");
+    bool check_file = argc > 1 && !strcmp(argv[1], "--check");
+    bool stream = argc > 1 && !strcmp(argv[1], "--stream");
+    SPELL_CONFIG config = defaultConfig();
+    if (loadConfig(CONFIG_FILE, &config)) fprintf(stderr, COLOR_GREEN "Settings loaded from %s\n" COLOR_RESET, CONFIG_FILE);
+    if (argc > 1 && !strcmp(argv[1], "--bench")){
+        FILE* out = argc > 2 ? fopen(argv[2], "w") : stdout;
+        if (out == NULL){
+            perror(COLOR_RED "Error opening benchmark output" COLOR_RESET);
+            return 1;
+        }
+        bool ok = runBenchmark(out, &config);
+        if (out != stdout) fclose(out);
+        return ok ? 0 : 1;
+    }
+    if (argc > 1 && !strcmp(argv[1], "--add")){
+        int added = addUserWords(&config, argv + 2, argc - 2);
+        if (added < 0) return 1;
+        fprintf(stderr, COLOR_GREEN "%d words added to %s\n" COLOR_RESET, added, config.userDictPath);
+        return 0;
     }
+    if (argc > 1 && !strcmp(argv[1], "--client")) return runClient(argc > 2 ? argv[2] : SOCKET_FILE, stdin, stdout) ? 0 : 1;
+    // --check takes the thread count after the file name
+    if (check_file && argc > 3) config.threads = greater(1, atoi(argv[3]));
+    SPELL_ENGINE* engine = createEngine(&config, build_only);
+    if (engine == NULL) return 1;
+    if (build_only) return 0;
+    fprintf(stderr, COLOR_BLUE "Dictionary loaded successfully.\n" COLOR_RESET);
 
-    while (fscanf(dict_ptr, "%s", dict_word) != EOF){
-        int distance = levenshteinDistance(word, dict_word);
-        double jaroWinklerValue = jaroWinklerDistance(word, dict_word);
-        if (distance < temp_LevenshteinValue){
-            temp_LevenshteinValue=distance;
-            lRUCachePut(obj, dict_word);
-        }
-        else if (distance == temp_LevenshteinValue && jaroWinklerValue >= temp_JaroWinklerValue){
-            temp_JaroWinklerValue=jaroWinklerValue;
-            lRUCachePut(obj, dict_word);
+    if (check_file){
+        const char* path = argc > 2 ? argv[2] : PARA_FILE;
+        struct timespec begin, finish;
+        long n_words;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        long misspelled = engineCheckFile(engine, path, stdout, &n_words);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        if (misspelled < 0){
+            freeEngine(engine);
+            return 1;
         }
+        double seconds = (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9;
+        fprintf(stderr, COLOR_CYAN "%ld words checked, %ld misspelled, in %f seconds on %d threads\n" COLOR_RESET, n_words, misspelled, seconds, engine->pool->nThreads);
+        engineCacheStats(engine, stderr);
+        freeEngine(engine);
+        return 0;
     }
 
-    int num_suggestions = 0;
-    struct LRUCacheQueueNode* temp=obj->head->forw;
-    while (temp!=obj->tail){
-        strcpy(suggestions[num_suggestions], temp->val);
-        num_suggestions++;
-        temp=temp->forw;
+    if (argc > 2 && !strcmp(argv[1], "--complete")){
+        char completions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+        int num_completions = normalizeWord(argv[2]) ? engineComplete(engine, argv[2], argc > 3 ? atoi(argv[3]) : MAX_SUGGESTIONS, completions) : 0;
+        for (int i = 0; i < num_completions; i++) printf("%s\n", completions[i]);
+        freeEngine(engine);
+        return 0;
     }
 
-    return num_suggestions;
-
-    fclose(dict_ptr);
-}
+    if (argc > 1 && !strcmp(argv[1], "--serve")){
+        bool ok = runServer(engine, argc > 2 ? argv[2] : SOCKET_FILE);
+        freeEngine(engine);
+        return ok ? 0 : 1;
+    }
 
-int main() {
-    // loading dictionary on bloom filter and trie
-    TRIE_NODE* root=createNode();
-    bool* filter = calloc(FILTER_SIZE, sizeof(bool));
-    loadDictionary(dict_file, filter, root);
-    printf(COLOR_BLUE "Dictionary loaded successfully.\n" COLOR_RESET);
+    if (stream){
+        int fd = (argc > 2 && strcmp(argv[2], "-")) ? open(argv[2], O_RDONLY) : STDIN_FILENO;
+        if (fd < 0){
+            perror(COLOR_RED "Error opening input" COLOR_RESET);
+            return 1;
+        }
+        long n_words;
+        long misspelled = engineCheckStream(engine, fd, stdout, &n_words);
+        fprintf(stderr, COLOR_CYAN "%ld words checked, %ld misspelled\n" COLOR_RESET, n_words, misspelled);
+        engineCacheStats(engine, stderr);
+        freeEngine(engine);
+        return 0;
+    }
     int ch;
-    char str[100];
+    char* str = NULL;
+    size_t str_cap = 0;
+    int suggest_cap = 16;
+    char (*display_suggest)[MAX_SUGGESTIONS + 1][MAX_LENGTH + 1] = malloc(suggest_cap * sizeof(*display_suggest));
     char word[MAX_LENGTH + 1];
-    double accuracyFilter=0;
-    LARGE_INTEGER start, end, freq;
-    double time_used_trie;
-    double time_used_filter;
-    double faster;
     int accurate_comp=0;
     int num_comp=0;
-    bool checkTrie;
-    bool checkFilter;
-
-    createQueue();
-    struct LRUCache* cache=lRUCacheCreate(MAX_SUGGESTIONS);
 
     while (1){
         printf(COLOR_YELLOW "Select the mode you want to enter:-\n1. Spell checking and autocorrect\n2. Comparison mode\n3. Optimisation mode\n4. Quit\n" COLOR_RESET);
-        scanf("%d", &ch);
+        if (scanf("%d", &ch) != 1) break;     // end of input, or not a number
         getchar();
         if (ch==1){
             while (1){
                 printf(COLOR_MAGENTA "Enter a sentence or type exit to leave:\n" COLOR_RESET);
-                fgets(str, sizeof(str), stdin);
+                if (getline(&str, &str_cap, stdin) < 0) break;
                 str[strcspn(str, "\n")] = 0;
                 if (!strcmp(str, "exit")) break;
                 printf(COLOR_MAGENTA "The sentence after checking is: \n" COLOR_RESET);
                 int index = 0, incrt_words = 0;
-                char display_suggest[MAX_INCRT_WORDS][MAX_SUGGESTIONS + 1][MAX_LENGTH];
 
                 for(int i=0, l=strlen(str); i<l; i++) {
                     char c = str[i];
-                    if(isalpha(c)) word[index++] = tolower(c);
+                    if(isalpha(c)) {
+                        if(index < MAX_LENGTH) word[index++] = tolower(c);
+                    }
                     else if(isdigit(c)) printf(COLOR_MAGENTA "\n Error no numbers...!" COLOR_RESET);
                     else if(index > 0) {
                         word[index] = '\0';
                         index = 0;
-                        if(!searchTrie(root, word)){
+                        if(!engineCheckWord(engine, word)){
                             printf(COLOR_RED "%s " COLOR_RESET, word);
+                            if(incrt_words == suggest_cap) display_suggest = realloc(display_suggest, (suggest_cap *= 2) * sizeof(*display_suggest));
                             strcpy(display_suggest[incrt_words][0], word);
                             char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
-                            int num_suggestions = suggest(word, cache, suggestions);
+                            int num_suggestions = engineSuggest(engine, word, suggestions);
                             if (num_suggestions > 0){
                                 for (int i = 0; i < num_suggestions; i++){
                                     strcpy(display_suggest[incrt_words][i + 1], suggestions[i]);
                                 }
                             }
+                            if (num_suggestions < MAX_SUGGESTIONS) display_suggest[incrt_words][num_suggestions + 1][0] = '\0';
                             incrt_words++;
                         }
                         else printf(COLOR_GREEN "%s " COLOR_RESET, word);
@@ -108,11 +150,12 @@ int main() {
                 }
                 if(index>0) {
                     word[index] = '\0';
-                    if(!searchTrie(root, word)) {
+                    if(!engineCheckWord(engine, word)) {
                         printf(COLOR_RED "%s " COLOR_RESET, word);
+                        if(incrt_words == suggest_cap) display_suggest = realloc(display_suggest, (suggest_cap *= 2) * sizeof(*display_suggest));
                         strcpy(display_suggest[incrt_words][0], word);
                         char suggestions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
-                        int num_suggestions = suggest(word, cache, suggestions);
+                        int num_suggestions = engineSuggest(engine, word, suggestions);
                         if (num_suggestions > 0)
                         {
                             for (int i = 0; i < num_suggestions; i++)
@@ -120,6 +163,7 @@ int main() {
                                 strcpy(display_suggest[incrt_words][i + 1], suggestions[i]);
                             }
                         }
+                        if (num_suggestions < MAX_SUGGESTIONS) display_suggest[incrt_words][num_suggestions + 1][0] = '\0';
                         incrt_words++;
                     }
                     else printf(COLOR_GREEN "%s " COLOR_RESET, word);
@@ -128,7 +172,7 @@ int main() {
                     printf(COLOR_MAGENTA "\nSuggestions for incorrect words:\n" COLOR_RESET);
                     for (int i=0; i<incrt_words; i++) {
                         printf(COLOR_RED "%d) ", i+1);
-                        for (int j=0; j<=MAX_SUGGESTIONS; j++) {
+                        for (int j=0; j<=MAX_SUGGESTIONS && display_suggest[i][j][0]; j++) {
                             if (j == 0) printf("%s -> " COLOR_RESET, display_suggest[i][0]);
                             else printf(COLOR_CYAN "%s " COLOR_RESET, display_suggest[i][j]);
                         }
@@ -139,26 +183,35 @@ int main() {
             }
         }
         else if (ch==2){
+            // the engine is entered per word, never across waiting for input, so a reload isn't held up
+            int ticket;
+            SPELL_DICTIONARY* dictionary = enterEngine(engine, &ticket);
+            DA_TRIE* dict = dictionary->dict;
+            BLOOM_FILTER* filter = dictionary->filter;
+            printf(COLOR_CYAN "Bloom Filter: %llu bits (%.2f MB), %d hash functions, target false positive rate %.2f percent\n" COLOR_RESET,
+                   (unsigned long long)filter->nBits, sizeFilter(filter) / 1e6, filter->k, filter->fpr * 100);
+            printf(COLOR_CYAN "Measured false positive rate against the trie: %f percent\n\n" COLOR_RESET, measureFalsePositiveRate(filter, dict, FPR_SAMPLES) * 100);
+            leaveEngine(engine, ticket);
             while (1){
                 printf(COLOR_MAGENTA "Enter a word or type exit to leave:\n" COLOR_RESET);
-                fgets(word, sizeof(word), stdin);
+                if (fgets(word, sizeof(word), stdin) == NULL) break;
                 word[strcspn(word, "\n")] = '\0';
                 if (!strcmp(word, "exit")) break;
 
-                LARGE_INTEGER start, end, freq;
-                bool checkTrie, checkFilter;
-                double time_used_trie, time_used_filter, faster, accuracyFilter = 0;
-                QueryPerformanceCounter(&start); 
-                checkTrie=searchTrie(root, word); 
-                QueryPerformanceCounter(&end);
-                QueryPerformanceFrequency(&freq);
-                time_used_trie+= (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
-                
-                QueryPerformanceCounter(&start); 
-                checkFilter=searchFilter(filter, word);
-                QueryPerformanceCounter(&end);
-                QueryPerformanceFrequency(&freq);
-                time_used_filter+= (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+                // one lookup is far below the clock's resolution, so each is repeated and averaged
+                bool checkTrie = false, checkFilter = false;
+                dictionary = enterEngine(engine, &ticket);
+                dict = dictionary->dict;
+                filter = dictionary->filter;
+                double start = monotonicSeconds();
+                for (int r = 0; r < COMPARE_REPEAT; r++) checkTrie |= searchDoubleArray(dict, word);
+                double time_used_trie = (monotonicSeconds() - start) / COMPARE_REPEAT;
+
+                start = monotonicSeconds();
+                for (int r = 0; r < COMPARE_REPEAT; r++) checkFilter |= searchFilter(filter, word);
+                double time_used_filter = (monotonicSeconds() - start) / COMPARE_REPEAT;
+                leaveEngine(engine, ticket);
+                double faster, accuracyFilter;
 
                 if (checkTrie && checkFilter){
                     printf(COLOR_MAGENTA "The word %s is present in both Tries and Bloom Filter\n" COLOR_RESET, word);
@@ -177,7 +230,8 @@ int main() {
                 num_comp++;
                 accuracyFilter=accurate_comp*100.0/num_comp;
                 printf(COLOR_CYAN "\nThe accuracy of Tries is %f percent\n", num_comp*100.0/num_comp);
-                printf("The accuracy of Bloom Filter %f percent\n\n" COLOR_RESET, accuracyFilter);
+                printf("The accuracy of Bloom Filter %f percent\n", accuracyFilter);
+                printf("Trie lookup %.1f ns, Bloom Filter lookup %.1f ns\n\n" COLOR_RESET, time_used_trie * 1e9, time_used_filter * 1e9);
                 
                 if (time_used_trie>time_used_filter){
                     faster=(time_used_trie-time_used_filter)*100/time_used_trie;
@@ -191,12 +245,23 @@ int main() {
             }
         }
         else if (ch==3){
-
+            printf(COLOR_MAGENTA "Enter a sample corpus file, or press enter for %s:\n" COLOR_RESET, PARA_FILE);
+            if (getline(&str, &str_cap, stdin) < 0) break;
+            str[strcspn(str, "\n")] = 0;
+            bool tuned = tuneConfig(str[0] ? str : PARA_FILE, engine, &config);
+            if (tuned && saveConfig(CONFIG_FILE, &config)){
+                printf(COLOR_GREEN "\nBest settings: filter fpr %g, %d hash functions, %s, cache %d, %d threads\n", config.filterFpr,
+                       config.filterK, config.filterBlocked ? "blocked" : "not blocked", config.cacheSize, config.threads);
+                printf("Saved to %s, they take effect on the next start\n" COLOR_RESET, CONFIG_FILE);
+            }
         }
         else if (ch==4) break;
         else printf("Invalid value!\n");
         printf("\n");
     }
     
+    free(str);
+    free(display_suggest);
+    freeEngine(engine);
     return 0;
 }
\ No newline at end of file
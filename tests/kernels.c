@@ -0,0 +1,439 @@
+// Kernel tests: each optimized kernel is checked against a plain reference on random inputs.
+// Run with `make test`, the exit status is the number of failed checks (capped at 1).
+# include <stdio.h>
+# include <stdlib.h>
+# include <stdbool.h>
+# include <stdint.h>
+# include <string.h>
+# include <ctype.h>
+# include <math.h>
+# include <time.h>
+# include <errno.h>
+# include <pthread.h>
+# if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# endif
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/resource.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <poll.h>
+# include <signal.h>
+# include "../spell.h"
+
+#define KERNEL_CASES 200000     // random inputs per kernel
+
+int failures = 0;
+
+// reports the first few mismatches of a kernel, counts them all
+void expect(bool ok, const char* kernel, const char* s, const char* t, double got, double want) {
+    if(ok) return;
+    if(failures++ < 10) fprintf(stderr, COLOR_RED "%s(\"%s\", \"%s\") = %g, expected %g\n" COLOR_RESET, kernel, s, t, got, want);
+}
+
+// a random word of min_len..max_len letters from the first alphabet letters, small alphabets give close pairs
+void randomWord(uint64_t* seed, char* word, int min_len, int max_len, int alphabet) {
+    int len = min_len + xorshift64(seed) % (max_len - min_len + 1);
+    for(int i=0; i<len; i++) word[i] = 'a' + xorshift64(seed) % alphabet;
+    word[len] = '\0';
+}
+
+// copies s into t with a few random insertions, deletions and substitutions
+void randomEdits(uint64_t* seed, const char* s, char* t, int edits) {
+    strcpy(t, s);
+    for(int e=0; e<edits; e++) {
+        int len = strlen(t), pos = len ? xorshift64(seed) % (len + 1) : 0, op = xorshift64(seed) % 3;
+        if(op == 0 && len < MAX_LENGTH) {
+            memmove(t + pos + 1, t + pos, len - pos + 1);
+            t[pos] = 'a' + xorshift64(seed) % 26;
+        }
+        else if(op == 1 && pos < len) memmove(t + pos, t + pos + 1, len - pos);
+        else if(pos < len) t[pos] = 'a' + xorshift64(seed) % 26;
+    }
+}
+
+// levenshteinBounded (bit-parallel Myers) against the full DP table, for every bound up to past the distance
+void testLevenshtein(void) {
+    uint64_t seed = 88172645463325252ULL;
+    char s[MAX_LENGTH + 1], t[MAX_LENGTH + 1];
+    for(int q=0; q<KERNEL_CASES; q++) {
+        randomWord(&seed, s, 0, q % 8 ? 12 : MAX_LENGTH, 2 + q % 5);
+        if(q % 2) randomEdits(&seed, s, t, xorshift64(&seed) % 5);
+        else randomWord(&seed, t, 0, q % 8 ? 12 : MAX_LENGTH, 2 + q % 5);
+        int d = levenshteinDistance(s, t);
+        for(int maxDist=0; maxDist<=d + 1; maxDist++) {
+            int want = d > maxDist ? maxDist + 1 : d, got = levenshteinBounded(s, t, maxDist);
+            expect(got == want, "levenshteinBounded", s, t, got, want);
+        }
+        expect(levenshteinBounded(s, t, MAX_LENGTH) == d, "levenshteinBounded", s, t, levenshteinBounded(s, t, MAX_LENGTH), d);
+    }
+}
+
+// textbook Jaro-Winkler with match flag arrays, as the kernel was before it went to bit masks
+double referenceJaroWinkler(const char* s1, const char* s2) {
+    int len1 = strlen(s1), len2 = strlen(s2);
+    if(len1 == 0 || len2 == 0) return (len1 == len2) ? 1.0 : 0.0;
+    int maxDist = greater(0, greater(len1, len2) / 2 - 1), match = 0;
+    bool matched1[MAX_LENGTH] = { false }, matched2[MAX_LENGTH] = { false };
+    for(int i=0; i<len1; i++) {
+        for(int j=greater(0, i - maxDist); j<smaller(len2, i + maxDist + 1); j++) {
+            if(s1[i] != s2[j] || matched2[j]) continue;
+            matched1[i] = matched2[j] = true;
+            match++;
+            break;
+        }
+    }
+    if(match == 0) return 0.0;
+    int t = 0, point = 0;
+    for(int i=0; i<len1; i++) {
+        if(!matched1[i]) continue;
+        while(!matched2[point]) point++;
+        if(s1[i] != s2[point++]) t++;
+    }
+    double jaro = ((double)match / len1 + (double)match / len2 + (match - t / 2.0) / match) / 3.0;
+    if(jaro <= JW_BOOST_THRESHOLD) return jaro;
+    int prefix = 0;
+    while(prefix < smallest(len1, len2, JW_PREFIX_LENGTH) && s1[prefix] == s2[prefix]) prefix++;
+    return jaro + prefix * JW_PREFIX_SCALE * (1.0 - jaro);
+}
+
+// jaroWinklerQuery (AVX2 and scalar windows) against the reference, each prepared query scoring several candidates
+void testJaroWinkler(void) {
+    uint64_t seed = 2463534242ULL;
+    char s[MAX_LENGTH + 1], t[MAX_LENGTH + 1];
+    JARO_QUERY query;
+    for(int q=0; q<KERNEL_CASES / 4; q++) {
+        randomWord(&seed, s, 0, q % 8 ? 12 : MAX_LENGTH, 2 + q % 5);
+        prepareJaroQuery(&query, s);
+        for(int c=0; c<4; c++) {
+            if(c % 2) randomEdits(&seed, s, t, xorshift64(&seed) % 5);
+            else randomWord(&seed, t, 0, q % 8 ? 12 : MAX_LENGTH, 2 + q % 5);
+            double want = referenceJaroWinkler(s, t), got = jaroWinklerQuery(&query, t);
+            expect(fabs(got - want) < 1e-12, "jaroWinklerQuery", s, t, got, want);
+#if defined(__x86_64__) || defined(__i386__)
+            // the scalar window scan too, on CPUs where the query picked AVX2
+            if(query.avx2) {
+                query.avx2 = false;
+                got = jaroWinklerQuery(&query, t);
+                expect(fabs(got - want) < 1e-12, "jaroWinklerQuery scalar", s, t, got, want);
+                query.avx2 = true;
+            }
+#endif
+        }
+    }
+}
+
+// the multi-key filter probes, scalar and AVX2, against the one key probe for several k
+void testFilterLanes(void) {
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    char word[MAX_LENGTH + 1];
+    uint32_t block[LOOKUP_BATCH], h2[LOOKUP_BATCH], step[LOOKUP_BATCH];
+    bool scalar[LOOKUP_BATCH], lanes[LOOKUP_BATCH];
+#if defined(__x86_64__) || defined(__i386__)
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    for(int k=1; k<=16; k++) {
+        BLOOM_FILTER* filter = createFilter(2000, 0.01, k, true);
+        uint64_t n_blocks = filter->nBits / 512;
+        for(int i=0; i<2000; i++) {
+            randomWord(&seed, word, 1, 8, 4);
+            insertFilter(filter, word);
+        }
+        for(int q=0; q<KERNEL_CASES / 16 / LOOKUP_BATCH; q++) {
+            int n = 1 + xorshift64(&seed) % LOOKUP_BATCH;       // mostly not a whole no. of lanes
+            for(int i=0; i<n; i++) {
+                randomWord(&seed, word, 1, 8, 4);
+                uint32_t h1 = djb2(word);
+                h2[i] = jenkin(word);
+                block[i] = h1 % n_blocks;
+                step[i] = (h1 / n_blocks) | 1;
+                bool want = searchFilterHash(filter, h1, h2[i]);
+                lanes[i] = !want;
+                scalar[i] = want;
+            }
+            searchFilterLanesScalar(filter, block, h2, step, n, lanes);
+            for(int i=0; i<n; i++) expect(lanes[i] == scalar[i], "searchFilterLanesScalar", "", "", lanes[i], scalar[i]);
+#if defined(__x86_64__) || defined(__i386__)
+            if(!avx2) continue;
+            for(int i=0; i<n; i++) lanes[i] = !scalar[i];
+            searchFilterLanesAvx2(filter, block, h2, step, n, lanes);
+            for(int i=0; i<n; i++) expect(lanes[i] == scalar[i], "searchFilterLanesAvx2", "", "", lanes[i], scalar[i]);
+#endif
+        }
+        freeFilter(filter);
+    }
+}
+
+#define COMPLETION_WORDS 6000   // random draws, about 3400 distinct words in 53 blocks
+#define COMPLETION_QUERIES 5000 // per ranking
+
+int compareWords(const void* a, const void* b) {
+    return strcmp((const char*)a, (const char*)b);
+}
+
+const DA_TRIE* ranked_da;       // the trie and words the brute force orders by
+char (*ranked_words)[MAX_LENGTH + 1];
+
+// highest frequency first, then shortest, then alphabetical (ids are alphabetical)
+int compareCompletions(const void* a, const void* b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    int fx = frequencyDoubleArray(ranked_da, x), fy = frequencyDoubleArray(ranked_da, y);
+    if(fx != fy) return fy - fx;
+    int lx = strlen(ranked_words[x]), ly = strlen(ranked_words[y]);
+    return lx != ly ? lx - ly : x - y;
+}
+
+// completeDoubleArray against sorting every word under the prefix
+void checkCompletions(const DA_TRIE* da, char (*words)[MAX_LENGTH + 1], int n_words, uint64_t* seed) {
+    int* matches = (int*)malloc(n_words * sizeof(int));
+    char prefix[MAX_LENGTH + 1], completions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+    for(int q=0; q<COMPLETION_QUERIES; q++) {
+        randomWord(seed, prefix, 0, 4, 7);      // 'g' never occurs, so some prefixes match nothing
+        int k = 1 + xorshift64(seed) % MAX_SUGGESTIONS, len = strlen(prefix), n_matches = 0;
+        for(int i=0; i<n_words; i++) if(!strncmp(words[i], prefix, len)) matches[n_matches++] = i;
+        qsort(matches, n_matches, sizeof(int), compareCompletions);
+        int want = smaller(k, n_matches), got = completeDoubleArray(da, prefix, k, completions);
+        expect(got == want, "completeDoubleArray count", prefix, "", got, want);
+        for(int i=0; i<smaller(got, want); i++)
+            expect(!strcmp(completions[i], words[matches[i]]), "completeDoubleArray", prefix, completions[i], i, matches[i]);
+    }
+    free(matches);
+}
+
+// top-k completion on a random dictionary, ranked by length alone and then with frequencies
+void testCompletion(void) {
+    uint64_t seed = 1181783497276652981ULL;
+    char (*words)[MAX_LENGTH + 1] = malloc(COMPLETION_WORDS * sizeof(*words));
+    int n_words = 0;
+    for(int i=0; i<COMPLETION_WORDS; i++) randomWord(&seed, words[i], 1, 7, 6);
+    qsort(words, COMPLETION_WORDS, sizeof(*words), compareWords);
+    for(int i=0; i<COMPLETION_WORDS; i++) {
+        if(n_words > 0 && !strcmp(words[i], words[n_words - 1])) continue;
+        if(n_words != i) strcpy(words[n_words], words[i]);
+        n_words++;
+    }
+
+    char dir[] = "/tmp/kernelsXXXXXX";
+    if(mkdtemp(dir) == NULL) {
+        perror(COLOR_RED "Error creating a test directory" COLOR_RESET);
+        failures++;
+        free(words);
+        return;
+    }
+    SPELL_CONFIG config = defaultConfig();
+    snprintf(config.dictPath, sizeof(config.dictPath), "%s/dictionary.txt", dir);
+    snprintf(config.userDictPath, sizeof(config.userDictPath), "%s/user_dictionary.txt", dir);
+    snprintf(config.freqPath, sizeof(config.freqPath), "%s/frequency.txt", dir);
+    FILE* dict_fp = fopen(config.dictPath, "w"), *freq_fp = fopen(config.freqPath, "w");
+    for(int i=0; i<n_words; i++) {
+        fprintf(dict_fp, "%s\n", words[i]);
+        // few distinct counts, so equal frequencies are common and the tie breaks get exercised
+        if(xorshift64(&seed) % 2) fprintf(freq_fp, "%s %d\n", words[i], 1 << (xorshift64(&seed) % 4 * 3));
+    }
+    fclose(dict_fp);
+    fclose(freq_fp);
+
+    ARENA trie_arenas[N + 1] = {{ NULL, NULL }};
+    TRIE_NODE* root = createNode(&trie_arenas[N]);
+    THREAD_POOL* pool = createThreadPool(1);
+    BLOOM_FILTER* filter = loadDictionary(&config, pool, root, trie_arenas);
+    DA_TRIE* da = buildDoubleArray(root);
+    for(int i=0; i<=N; i++) arenaFree(&trie_arenas[i]);
+    ranked_da = da;
+    ranked_words = words;
+
+    for(int pass=0; pass<2; pass++) {
+        if(pass == 1) {
+            free(da->score);
+            free(da->best);
+            loadFrequencies(da, config.freqPath);
+        }
+        rankCompletions(da);
+        checkCompletions(da, words, n_words, &seed);
+    }
+
+    freeDoubleArray(da);
+    freeFilter(filter);
+    freeThreadPool(pool);
+    remove(config.dictPath);
+    remove(config.freqPath);
+    rmdir(dir);
+    free(words);
+}
+
+// snapshot file bytes, with the header and the double-array arrays picked out
+typedef struct snapshot_image {
+    char* bytes;
+    size_t size;
+    SNAPSHOT_HEADER* header;
+    int* next;
+    int* rank;
+} SNAPSHOT_IMAGE;
+
+bool readSnapshotImage(const char* path, SNAPSHOT_IMAGE* image) {
+    FILE* fp = fopen(path, "rb");
+    if(fp == NULL) return false;
+    fseek(fp, 0, SEEK_END);
+    image->size = ftell(fp);
+    rewind(fp);
+    image->bytes = (char*)malloc(image->size);
+    bool ok = fread(image->bytes, 1, image->size, fp) == image->size;
+    fclose(fp);
+    image->header = (SNAPSHOT_HEADER*)image->bytes;
+    image->next = (int*)(image->bytes + image->header->daOffset);
+    image->rank = image->next + image->header->daSize;
+    return ok;
+}
+
+// writes image with one int of the double-array replaced and tries to map it
+bool loadCorrupted(const SPELL_CONFIG* config, const SOURCE_FILES* sources, const SNAPSHOT_IMAGE* image, int* field, int value) {
+    int saved = *field;
+    *field = value;
+    FILE* fp = fopen(config->snapshotPath, "wb");
+    fwrite(image->bytes, 1, image->size, fp);
+    fclose(fp);
+    *field = saved;
+    DA_TRIE* da;
+    BLOOM_FILTER* filter;
+    if(!loadSnapshot(config, sources, &da, &filter)) return false;
+    freeFilter(filter);
+    freeDoubleArray(da);
+    return true;
+}
+
+// a snapshot whose ranks or edges were tampered with must be rejected, not walked
+void testSnapshot(void) {
+    const char* words[] = { "a", "ab", "abc", "b", "ba", "bad", "cab" };
+    char dir[] = "/tmp/kernelsXXXXXX";
+    if(mkdtemp(dir) == NULL) {
+        perror(COLOR_RED "Error creating a test directory" COLOR_RESET);
+        failures++;
+        return;
+    }
+    SPELL_CONFIG config = defaultConfig();
+    snprintf(config.dictPath, sizeof(config.dictPath), "%s/dictionary.txt", dir);
+    snprintf(config.userDictPath, sizeof(config.userDictPath), "%s/user_dictionary.txt", dir);
+    snprintf(config.freqPath, sizeof(config.freqPath), "%s/frequency.txt", dir);
+    snprintf(config.snapshotPath, sizeof(config.snapshotPath), "%s/dictionary.bin", dir);
+    FILE* fp = fopen(config.dictPath, "w");
+    for(size_t i=0; i<sizeof(words)/sizeof(words[0]); i++) fprintf(fp, "%s\n", words[i]);
+    fclose(fp);
+    THREAD_POOL* pool = createThreadPool(1);
+    SPELL_DICTIONARY* dictionary = loadEngineDictionary(&config, pool, true);
+    freeThreadPool(pool);
+
+    // completion on a damaged in-memory trie, which never went through the loader, finds nothing
+    DA_TRIE* built = dictionary->dict;
+    char completions[MAX_SUGGESTIONS][MAX_LENGTH + 1];
+    int a_edge = built->root + 1, a_state = built->next[a_edge], saved = built->rank[a_edge];
+    built->rank[a_edge] = 2000000000;
+    int got = completeDoubleArray(built, "ab", MAX_SUGGESTIONS, completions);
+    expect(got == 0, "completeDoubleArray", "ab", "rank past every id", got, 0);
+    built->rank[a_edge] = saved;
+    saved = built->next[a_state + 2];
+    built->next[a_state + 2] = a_state;     // "ab" loops back onto "a"
+    got = completeDoubleArray(built, "a", MAX_SUGGESTIONS, completions);
+    expect(got == 0, "completeDoubleArray", "a", "edge onto its parent", got, 0);
+    built->next[a_state + 2] = saved;
+    freeEngineDictionary(dictionary);
+
+    SOURCE_FILES sources;
+    statSources(&config, &sources);
+    SNAPSHOT_IMAGE image;
+    if(!readSnapshotImage(config.snapshotPath, &image)) {
+        expect(false, "saveSnapshot", config.snapshotPath, "", 0, 1);
+        rmdir(dir);
+        return;
+    }
+    int root = image.header->daRoot, size = image.header->daSize;
+    int a = image.next[root + 1], ab = image.next[a + 2];       // states after "a" and "ab"
+    struct { const char* what; int* field; int value; } cases[] = {
+        { "untouched", &image.rank[root + 1], 0 },
+        { "rank past every id", &image.rank[root + 1], 2000000000 },
+        { "rank one too high", &image.rank[root + 2], image.rank[root + 2] + 1 },
+        { "edge past the arrays", &image.next[root + 1], size },
+        { "edge back to the root", &image.next[a + 2], root },
+        { "edge onto its own state", &image.next[ab + 3], ab },
+    };
+    for(size_t i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+        bool loaded = loadCorrupted(&config, &sources, &image, cases[i].field, cases[i].value);
+        expect(loaded == (i == 0), "loadSnapshot", cases[i].what, "", loaded, i == 0);
+    }
+    free(image.bytes);
+    remove(config.snapshotPath);
+    remove(config.dictPath);
+    rmdir(dir);
+}
+
+// nextToken over several STREAM_CHUNK refills against a plain scan of the whole text: offsets, lengths
+// and lower cased words, with words straddling chunk boundaries, words past MAX_LENGTH and no final delimiter
+void testTokenizer(void) {
+    uint64_t seed = 2463534242ULL;
+    const char delimiters[] = " \n\t.,;:!?'-0123456789";
+    long size = 3 * STREAM_CHUNK + 12345;
+    char* text = (char*)malloc(size);
+    for(long i=0; i<size; ) {
+        int len = xorshift64(&seed) % 16 == 0 ? 40 + xorshift64(&seed) % 30 : 1 + xorshift64(&seed) % 12;
+        for(int j=0; j<len && i<size; j++) text[i++] = (xorshift64(&seed) & 1 ? 'a' : 'A') + xorshift64(&seed) % 26;
+        for(int j=1 + xorshift64(&seed) % 2; j>0 && i<size; j--) text[i++] = delimiters[xorshift64(&seed) % (sizeof(delimiters) - 1)];
+    }
+    // a short word across the first chunk end, a long one across the second, a word ending the input
+    memcpy(text + STREAM_CHUNK - 4, " abCDefgh ", 10);
+    memset(text + 2 * STREAM_CHUNK - 30, 'q', 60);
+    memcpy(text + size - 6, " Word", 5);
+    text[size - 1] = 'z';
+
+    FILE* fp = tmpfile();
+    fwrite(text, 1, size, fp);
+    fflush(fp);
+    lseek(fileno(fp), 0, SEEK_SET);
+
+    TOKENIZER tok;
+    tok.buffer = (char*)malloc(STREAM_CHUNK + MAX_LENGTH + 2);
+    tok.pos = tok.len = tok.base = 0;
+    tok.eof = tok.skipping = false;
+    long expected = 0, tokens = 0;
+    char want[MAX_LENGTH + 1];
+    while(refillTokenizer(&tok, fileno(fp))) {
+        long offset;
+        int len;
+        char* word;
+        while((word = nextToken(&tok, &offset, &len)) != NULL) {
+            // the next word of the plain scan
+            long begin, end = expected;
+            do {
+                for(begin = end; begin < size && !isalpha((unsigned char)text[begin]); begin++);
+                for(end = begin; end < size && isalpha((unsigned char)text[end]); end++);
+            } while(end - begin > MAX_LENGTH);
+            expected = end;
+            int want_len = end - begin;
+            for(int i=0; i<want_len && i<=MAX_LENGTH; i++) want[i] = tolower((unsigned char)text[begin + i]);
+            want[want_len <= MAX_LENGTH ? want_len : 0] = '\0';
+            expect(offset == begin, "nextToken offset", word, want, offset, begin);
+            expect(len == want_len, "nextToken length", word, want, len, want_len);
+            expect(strcmp(word, want) == 0 && (int)strlen(word) == len, "nextToken word", word, want, 0, 0);
+            tokens++;
+        }
+    }
+    // nothing left over in the plain scan
+    while(expected < size && !isalpha((unsigned char)text[expected])) expected++;
+    expect(expected == size && tokens > 0, "nextToken end", "", "", expected, size);
+    free(tok.buffer);
+    fclose(fp);
+    free(text);
+}
+
+int main(void) {
+    testLevenshtein();
+    testJaroWinkler();
+    testFilterLanes();
+    testCompletion();
+    testSnapshot();
+    testTokenizer();
+    if(failures) fprintf(stderr, COLOR_RED "%d kernel checks failed\n" COLOR_RESET, failures);
+    else fprintf(stderr, COLOR_GREEN "All kernel checks passed\n" COLOR_RESET);
+    return failures != 0;
+}